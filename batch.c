@@ -0,0 +1,777 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__SSE2__) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define BATCH_HAVE_AVX2 1
+#endif
+
+#include "batch.h"
+#include "opcodes.h"
+
+// The 8xyN family plus 6xkk and 7xkk, which are the opcodes worth running
+// across lanes in vector registers
+typedef enum {
+    ALU_SET, ALU_ADDI,
+    ALU_MOV, ALU_OR, ALU_AND, ALU_XOR,
+    ALU_ADD, ALU_SUB, ALU_SHR, ALU_SUBN, ALU_SHL
+} alu_op;
+
+typedef void (*alu_fn)(alu_op op, unsigned char *vx, const unsigned char *vy, unsigned char *vf,
+                       unsigned char imm, const unsigned char *mask, int stride);
+
+// Both set up once by setupTables(), whichever thread creates the first
+// batch, and only read after that
+static alu_fn alu = NULL;
+
+// Each sprite byte expanded to the 8 VRAM bytes it XORs onto
+static uint64_t spriteRows[256];
+
+static pthread_once_t tablesOnce = PTHREAD_ONCE_INIT;
+
+/*************************************************
+ ** ALU KERNELS
+ **
+ ** vx, vy and vf may alias, so the flag is always stored before Vx is
+ ** recomputed from freshly loaded registers, exactly like opcode8 does.
+ ************************************************/
+static inline void aluLane(alu_op op, unsigned char *vx, const unsigned char *vy, unsigned char *vf,
+                           unsigned char imm, int l) {
+    switch (op) {
+    case ALU_SET:  vx[l] = imm; break;
+    case ALU_ADDI: vx[l] += imm; break;
+    case ALU_MOV:  vx[l] = vy[l]; break;
+    case ALU_OR:   vx[l] |= vy[l]; break;
+    case ALU_AND:  vx[l] &= vy[l]; break;
+    case ALU_XOR:  vx[l] ^= vy[l]; break;
+    case ALU_ADD:
+        do {
+            int val = vx[l] + vy[l];
+            vf[l] = val > 0xFF ? 1 : 0;
+            vx[l] = val & 0xFF;
+        } while (0);
+        break;
+    case ALU_SUB:
+        vf[l] = vx[l] > vy[l] ? 1 : 0;
+        vx[l] -= vy[l];
+        break;
+    case ALU_SHR:
+        vf[l] = vx[l] & 0x01;
+        vx[l] = vx[l] >> 1;
+        break;
+    case ALU_SUBN:
+        vf[l] = vy[l] > vx[l] ? 1 : 0;
+        vx[l] = vy[l] - vx[l];
+        break;
+    case ALU_SHL:
+        vf[l] = (vx[l] & 0x80) >> 7;
+        vx[l] = vx[l] << 1;
+        break;
+    }
+}
+
+static void alu_scalar(alu_op op, unsigned char *vx, const unsigned char *vy, unsigned char *vf,
+                       unsigned char imm, const unsigned char *mask, int stride) {
+    for (int l = 0; l < stride; ++l)
+        if (mask[l])
+            aluLane(op, vx, vy, vf, imm, l);
+}
+
+// The same over a list of lanes, for groups too small to be worth a pass
+// over every lane; one loop per op, as a switch per lane costs more than
+// most of these ops
+static void aluLanes(alu_op op, unsigned char *vx, const unsigned char *vy, unsigned char *vf,
+                     unsigned char imm, const int *lanes, int n) {
+#define EACH_LANE for (int i = 0, l; i < n && (l = lanes[i], 1); ++i)
+    switch (op) {
+    case ALU_SET:  EACH_LANE vx[l] = imm; break;
+    case ALU_ADDI: EACH_LANE vx[l] += imm; break;
+    case ALU_MOV:  EACH_LANE vx[l] = vy[l]; break;
+    case ALU_OR:   EACH_LANE vx[l] |= vy[l]; break;
+    case ALU_AND:  EACH_LANE vx[l] &= vy[l]; break;
+    case ALU_XOR:  EACH_LANE vx[l] ^= vy[l]; break;
+    default:       EACH_LANE aluLane(op, vx, vy, vf, imm, l); break;
+    }
+#undef EACH_LANE
+}
+
+#if defined(BATCH_HAVE_AVX2)
+#define LOAD(p)     _mm256_load_si256((const __m256i *) (p))
+#define STORE(p, v) _mm256_store_si256((__m256i *) (p), (v))
+
+// unsigned a > b, as 0x00/0xFF per byte
+__attribute__((target("avx2")))
+static inline __m256i gtu8(__m256i a, __m256i b) {
+    const __m256i bias = _mm256_set1_epi8((char) 0x80);
+    return _mm256_cmpgt_epi8(_mm256_xor_si256(a, bias), _mm256_xor_si256(b, bias));
+}
+
+__attribute__((target("avx2")))
+static void alu_avx2(alu_op op, unsigned char *vx, const unsigned char *vy, unsigned char *vf,
+                     unsigned char imm, const unsigned char *mask, int stride) {
+    const __m256i one = _mm256_set1_epi8(1);
+    const __m256i low7 = _mm256_set1_epi8(0x7F);
+    const __m256i k = _mm256_set1_epi8((char) imm);
+
+    for (int c = 0; c < stride; c += 32) {
+        __m256i m = LOAD(mask + c);
+        __m256i x = LOAD(vx + c);
+        __m256i y = LOAD(vy + c);
+        __m256i flag, r;
+
+        switch (op) {
+        case ALU_SET:  r = k; break;
+        case ALU_ADDI: r = _mm256_add_epi8(x, k); break;
+        case ALU_MOV:  r = y; break;
+        case ALU_OR:   r = _mm256_or_si256(x, y); break;
+        case ALU_AND:  r = _mm256_and_si256(x, y); break;
+        case ALU_XOR:  r = _mm256_xor_si256(x, y); break;
+        case ALU_ADD:
+            // carry out of x + y is x > ~y
+            r = _mm256_add_epi8(x, y);
+            flag = _mm256_and_si256(gtu8(x, _mm256_xor_si256(y, _mm256_set1_epi8(-1))), one);
+            STORE(vf + c, _mm256_blendv_epi8(LOAD(vf + c), flag, m));
+            break;
+        case ALU_SUB:
+            flag = _mm256_and_si256(gtu8(x, y), one);
+            STORE(vf + c, _mm256_blendv_epi8(LOAD(vf + c), flag, m));
+            r = _mm256_sub_epi8(LOAD(vx + c), LOAD(vy + c));
+            break;
+        case ALU_SHR:
+            flag = _mm256_and_si256(x, one);
+            STORE(vf + c, _mm256_blendv_epi8(LOAD(vf + c), flag, m));
+            r = _mm256_and_si256(_mm256_srli_epi16(LOAD(vx + c), 1), low7);
+            break;
+        case ALU_SUBN:
+            flag = _mm256_and_si256(gtu8(y, x), one);
+            STORE(vf + c, _mm256_blendv_epi8(LOAD(vf + c), flag, m));
+            r = _mm256_sub_epi8(LOAD(vy + c), LOAD(vx + c));
+            break;
+        case ALU_SHL:
+            flag = _mm256_and_si256(_mm256_srli_epi16(x, 7), one);
+            STORE(vf + c, _mm256_blendv_epi8(LOAD(vf + c), flag, m));
+            x = LOAD(vx + c);
+            r = _mm256_add_epi8(x, x);
+            break;
+        default:
+            r = x;
+            break;
+        }
+
+        STORE(vx + c, _mm256_blendv_epi8(LOAD(vx + c), r, m));
+    }
+}
+
+#undef LOAD
+#undef STORE
+#endif
+
+static alu_fn pickAlu(void) {
+#if defined(BATCH_HAVE_AVX2)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return alu_avx2;
+#endif
+    return alu_scalar;
+}
+
+/*************************************************
+ ** SETUP
+ ************************************************/
+static void *lanesAlloc(size_t size) {
+    // aligned_alloc wants a multiple of the alignment
+    size = (size + BATCH_LANE_ALIGN - 1) / BATCH_LANE_ALIGN * BATCH_LANE_ALIGN;
+    void *p = aligned_alloc(BATCH_LANE_ALIGN, size);
+    if (p)
+        memset(p, 0, size);
+    return p;
+}
+
+static void setupTables(void) {
+    alu = pickAlu();
+    for (int s = 0; s < 256; ++s) {
+        unsigned char row[8];
+        for (int b = 0; b < 8; ++b)
+            row[7 - b] = (s >> b) & 0x01;
+        memcpy(&spriteRows[s], row, 8);
+    }
+}
+
+chip8_batch_t *chip8_batchNew(int lanes, int cyclesPerStep) {
+    if (lanes < 1)
+        return NULL;
+
+    pthread_once(&tablesOnce, setupTables);
+
+    chip8_batch_t *batch = calloc(1, sizeof(chip8_batch_t));
+    if (!batch)
+        return NULL;
+
+    int stride = (lanes + BATCH_LANE_ALIGN - 1) / BATCH_LANE_ALIGN * BATCH_LANE_ALIGN;
+    batch->lanes = lanes;
+    batch->stride = stride;
+    batch->cyclesPerStep = cyclesPerStep;
+
+    batch->V = lanesAlloc(NUM_REGISTERS * stride);
+    batch->I = lanesAlloc(stride * sizeof(unsigned short));
+    batch->PC = lanesAlloc(stride * sizeof(unsigned short));
+    batch->SP = lanesAlloc(stride * sizeof(unsigned short));
+    batch->stack = lanesAlloc(STACKSIZE * stride * sizeof(unsigned short));
+    batch->delay_timer = lanesAlloc(stride);
+    batch->sound_timer = lanesAlloc(stride);
+    batch->keys = lanesAlloc(stride * sizeof(uint16_t));
+    batch->halted = lanesAlloc(stride);
+    batch->error = lanesAlloc(stride);
+    batch->rng = lanesAlloc(stride * sizeof(unsigned int));
+    batch->RAM = lanesAlloc((size_t) lanes * RAMSIZE);
+    batch->VRAM = lanesAlloc((size_t) lanes * VRAMSIZE);
+    batch->op = lanesAlloc(stride * sizeof(unsigned short));
+    batch->mask = lanesAlloc(stride);
+    batch->order = lanesAlloc(stride * sizeof(int));
+    batch->groupPC = lanesAlloc(stride * sizeof(unsigned short));
+    batch->groupStart = lanesAlloc((stride + 1) * sizeof(int));
+
+    if (!batch->V || !batch->I || !batch->PC || !batch->SP || !batch->stack
+        || !batch->delay_timer || !batch->sound_timer || !batch->keys || !batch->halted
+        || !batch->error || !batch->rng || !batch->RAM || !batch->VRAM || !batch->op || !batch->mask
+        || !batch->order || !batch->groupPC || !batch->groupStart) {
+        chip8_batchDestroy(batch);
+        return NULL;
+    }
+
+    // padding lanes never run
+    for (int l = lanes; l < stride; ++l)
+        batch->halted[l] = 1;
+
+    chip8_batchSeed(batch, 1);
+
+    return batch;
+}
+
+void chip8_batchDestroy(chip8_batch_t *batch) {
+    if (!batch)
+        return;
+
+    free(batch->V);
+    free(batch->I);
+    free(batch->PC);
+    free(batch->SP);
+    free(batch->stack);
+    free(batch->delay_timer);
+    free(batch->sound_timer);
+    free(batch->keys);
+    free(batch->halted);
+    free(batch->error);
+    free(batch->rng);
+    free(batch->RAM);
+    free(batch->VRAM);
+    free(batch->op);
+    free(batch->mask);
+    free(batch->order);
+    free(batch->groupPC);
+    free(batch->groupStart);
+    free(batch);
+}
+
+// Puts every lane in the state of machine (typically one that has just
+// had a ROM loaded), random generator included, so each lane replays
+// exactly what the machine would; chip8_batchSeed afterwards gives the
+// lanes sequences of their own
+void chip8_batchReset(chip8_batch_t *batch, const chip8_t *machine) {
+    int stride = batch->stride;
+
+    for (int l = 0; l < batch->lanes; ++l) {
+        for (int r = 0; r < NUM_REGISTERS; ++r)
+            batch->V[r * stride + l] = machine->V[r];
+        for (int s = 0; s < STACKSIZE; ++s)
+            batch->stack[s * stride + l] = machine->stack[s];
+
+        batch->keys[l] = 0;
+        for (int k = 0; k < 16; ++k)
+            batch->keys[l] |= (machine->keys[k] != 0) << k;
+
+        batch->I[l] = machine->I;
+        batch->PC[l] = machine->PC;
+        batch->SP[l] = machine->SP;
+        batch->delay_timer[l] = machine->delay_timer;
+        batch->sound_timer[l] = machine->sound_timer;
+        batch->rng[l] = machine->rng;
+        batch->error[l] = machine->error;
+        batch->halted[l] = machine->error == CHIP8_ERR_STACK_OVERFLOW
+                        || machine->error == CHIP8_ERR_STACK_UNDERFLOW;
+
+        memcpy(batch->RAM + (size_t) l * RAMSIZE, machine->RAM, RAMSIZE);
+        memcpy(batch->VRAM + (size_t) l * VRAMSIZE, machine->VRAM, VRAMSIZE);
+    }
+
+    memset(batch->written, 0, RAMSIZE);
+}
+
+void chip8_batchSeed(chip8_batch_t *batch, uint32_t seed) {
+    for (int l = 0; l < batch->stride; ++l) {
+        uint32_t s = seed ^ ((uint32_t) l * 0x9E3779B9u);
+        batch->rng[l] = s ? s : 0x2545F491u;
+    }
+}
+
+// Copies one lane out into a regular machine
+void chip8_batchGetLane(const chip8_batch_t *batch, int lane, chip8_t *machine) {
+    int stride = batch->stride;
+
+    for (int r = 0; r < NUM_REGISTERS; ++r)
+        machine->V[r] = batch->V[r * stride + lane];
+    for (int s = 0; s < STACKSIZE; ++s)
+        machine->stack[s] = batch->stack[s * stride + lane];
+    for (int k = 0; k < 16; ++k)
+        machine->keys[k] = (batch->keys[lane] >> k) & 1;
+
+    machine->opcode = batch->op[lane];
+    machine->I = batch->I[lane];
+    machine->PC = batch->PC[lane];
+    machine->SP = batch->SP[lane];
+    machine->delay_timer = batch->delay_timer[lane];
+    machine->sound_timer = batch->sound_timer[lane];
+    machine->redraw = 0;
+    machine->rng = batch->rng[lane];
+    machine->host = NULL;
+    machine->error = batch->error[lane];
+
+    memcpy(machine->RAM, batch->RAM + (size_t) lane * RAMSIZE, RAMSIZE);
+    memcpy(machine->VRAM, batch->VRAM + (size_t) lane * VRAMSIZE, VRAMSIZE);
+}
+
+/*************************************************
+ ** EXECUTION
+ ************************************************/
+// Stops lane l on a stack error. chip8_cycle still counts the timers down
+// on the cycle that fails and never again after, so that happens here.
+static void halt(chip8_batch_t *batch, int l, chip8_error error) {
+    batch->error[l] = error;
+    batch->halted[l] = 1;
+    batch->sound_timer[l] -= batch->sound_timer[l] > 0;
+    batch->delay_timer[l] -= batch->delay_timer[l] > 0;
+}
+
+// Flags lanes the way opcodes.c does for an opcode it doesn't know; the
+// lanes keep running
+static void unknownOpcode(chip8_batch_t *batch, const int *lanes, int n) {
+    for (int i = 0; i < n; ++i)
+        batch->error[lanes[i]] = CHIP8_ERR_UNKNOWN_OPCODE;
+}
+
+// Runs opcode on a single lane; the same semantics as opcodes.c, for the
+// opcodes that touch memory, the stack, the screen or the keys
+static void laneExec(chip8_batch_t *batch, int l, unsigned short opcode) {
+    int stride = batch->stride;
+    int x = (opcode & 0x0F00) >> 8;
+    int y = (opcode & 0x00F0) >> 4;
+    int kk = opcode & 0x00FF;
+    unsigned char *RAM = batch->RAM + (size_t) l * RAMSIZE;
+    unsigned char *VRAM = batch->VRAM + (size_t) l * VRAMSIZE;
+    unsigned short *PC = &batch->PC[l];
+    unsigned short *I = &batch->I[l];
+    unsigned short *SP = &batch->SP[l];
+
+#define V(r) batch->V[(r) * stride + l]
+
+    switch (opcode >> 12) {
+    case 0x0:
+        if (opcode == 0x00E0) {
+            memset(VRAM, 0, VRAMSIZE);
+        }
+        else if (opcode == 0x00EE) {
+            if (*SP == 0) {
+                halt(batch, l, CHIP8_ERR_STACK_UNDERFLOW);
+                return;
+            }
+            --*SP;
+            *PC = batch->stack[*SP * stride + l];
+            return;
+        }
+        *PC += 2;
+        break;
+    case 0x2:
+        if (*SP >= STACKSIZE) {
+            halt(batch, l, CHIP8_ERR_STACK_OVERFLOW);
+            return;
+        }
+        batch->stack[*SP * stride + l] = *PC + 2;
+        ++*SP;
+        *PC = opcode & 0x0FFF;
+        break;
+    case 0xC:
+        V(x) = opcodes_randint(&batch->rng[l], 256) & kk;
+        *PC += 2;
+        break;
+    case 0xD:
+        do {
+            int n = opcode & 0x000F;
+            int Vx = V(x) % CHIP8_WIDTH;
+            int Vy = V(y);
+            unsigned char erased = 0;
+
+            for (int i = 0; i < n; ++i) {
+                int sprite = RAM[(*I + i) & 0x0FFF];
+                unsigned char *row = VRAM + ((Vy + i) % CHIP8_HEIGHT) * CHIP8_WIDTH;
+                if (!sprite)
+                    continue;
+                if (Vx <= CHIP8_WIDTH - 8) {
+                    // all 8 pixels in one go when the row doesn't wrap
+                    uint64_t pixels, bits = spriteRows[sprite];
+                    memcpy(&pixels, row + Vx, 8);
+                    erased |= (pixels & bits) != 0;
+                    pixels ^= bits;
+                    memcpy(row + Vx, &pixels, 8);
+                    continue;
+                }
+                for (int b = 0; b < 8; b++) {
+                    unsigned char bit = (sprite >> b) & 0x01;
+                    int Sx = Vx + (7 - b);
+                    if (Sx >= CHIP8_WIDTH) { Sx -= CHIP8_WIDTH; }
+                    erased |= bit & row[Sx];
+                    row[Sx] ^= bit;
+                }
+            }
+
+            V(0xF) = erased;
+            *PC += 2;
+        } while (0);
+        break;
+    case 0xE:
+        do {
+            int pressed = (batch->keys[l] >> (V(x) & 0x0F)) & 1;
+            if (kk == 0x9E && pressed)
+                *PC += 2;
+            else if (kk == 0xA1 && !pressed)
+                *PC += 2;
+            else if (kk != 0x9E && kk != 0xA1)
+                batch->error[l] = CHIP8_ERR_UNKNOWN_OPCODE;
+            *PC += 2;
+        } while (0);
+        break;
+    case 0xF:
+        switch (kk) {
+        case 0x07:
+            V(x) = batch->delay_timer[l];
+            break;
+        case 0x0A:
+            // the lowest key held, as opcodeF finds it
+            if (!batch->keys[l])
+                return; // without advancing the PC
+            V(x) = __builtin_ctz(batch->keys[l]);
+            break;
+        case 0x15:
+            batch->delay_timer[l] = V(x);
+            break;
+        case 0x18:
+            batch->sound_timer[l] = V(x);
+            break;
+        case 0x1E:
+            *I += V(x);
+            V(0xF) = (*I + V(x) > 0xFFF) ? 1 : 0;
+            break;
+        case 0x29:
+            *I = FONTBASEADDR + V(x) * 5;
+            break;
+        case 0x33:
+            batch->written[*I & 0x0FFF] = 1;
+            batch->written[(*I + 1) & 0x0FFF] = 1;
+            batch->written[(*I + 2) & 0x0FFF] = 1;
+            RAM[*I & 0x0FFF]       = V(x) / 100;
+            RAM[(*I + 1) & 0x0FFF] = (V(x) % 100) / 10;
+            RAM[(*I + 2) & 0x0FFF] = V(x) % 10;
+            break;
+        case 0x55:
+            for (int i = 0; i <= x; ++i) {
+                batch->written[(*I + i) & 0x0FFF] = 1;
+                RAM[(*I + i) & 0x0FFF] = V(i);
+            }
+            break;
+        case 0x65:
+            for (int i = 0; i <= x; ++i)
+                V(i) = RAM[(*I + i) & 0x0FFF];
+            break;
+        default:
+            batch->error[l] = CHIP8_ERR_UNKNOWN_OPCODE;
+            break;
+        }
+        *PC += 2;
+        break;
+    }
+
+#undef V
+}
+
+static inline void advancePC(chip8_batch_t *batch, const int *lanes, int n) {
+    unsigned short *PC = batch->PC;
+
+    for (int i = 0; i < n; ++i)
+        PC[lanes[i]] += 2;
+}
+
+// Runs an ALU opcode on lanes. A group that covers a good part of the
+// batch goes through the vector kernel under a mask, a smaller one lane
+// by lane, so a cycle costs about the same however the lanes are split.
+static void groupAlu(chip8_batch_t *batch, alu_op op, unsigned char *vx, const unsigned char *vy,
+                     unsigned char *vf, unsigned char imm, const int *lanes, int n) {
+    int stride = batch->stride;
+    unsigned char *mask = batch->mask;
+
+    if (n * 8 < stride) {
+        aluLanes(op, vx, vy, vf, imm, lanes, n);
+        return;
+    }
+
+    memset(mask, 0, stride);
+    for (int i = 0; i < n; ++i)
+        mask[lanes[i]] = 0xFF;
+    alu(op, vx, vy, vf, imm, mask, stride);
+}
+
+// Executes opcode on the n lanes listed in lanes
+static void groupExec(chip8_batch_t *batch, unsigned short opcode, const int *lanes, int n) {
+    static const signed char alu8[16] = {
+        ALU_MOV, ALU_OR, ALU_AND, ALU_XOR, ALU_ADD, ALU_SUB, ALU_SHR, ALU_SUBN,
+        -1, -1, -1, -1, -1, -1, ALU_SHL, -1
+    };
+
+    int stride = batch->stride;
+    int x = (opcode & 0x0F00) >> 8;
+    int y = (opcode & 0x00F0) >> 4;
+    int kk = opcode & 0x00FF;
+    int nnn = opcode & 0x0FFF;
+    unsigned char *Vx = batch->V + x * stride;
+    unsigned char *Vy = batch->V + y * stride;
+    unsigned char *VF = batch->V + 0xF * stride;
+    unsigned short *PC = batch->PC;
+    unsigned short *I = batch->I;
+
+    switch (opcode >> 12) {
+    case 0x1:
+        for (int i = 0; i < n; ++i)
+            PC[lanes[i]] = nnn;
+        break;
+    // lanes branch their own ways here, so the skips are arithmetic: a
+    // mispredicted branch per lane costs more than the rest of the opcode
+    case 0x3:
+        for (int i = 0; i < n; ++i)
+            PC[lanes[i]] += 2 + 2 * (Vx[lanes[i]] == kk);
+        break;
+    case 0x4:
+        for (int i = 0; i < n; ++i)
+            PC[lanes[i]] += 2 + 2 * (Vx[lanes[i]] != kk);
+        break;
+    case 0x5:
+        // like opcode5, anything but 5xy0 leaves the PC alone
+        if ((opcode & 0x000F) == 0)
+            for (int i = 0; i < n; ++i)
+                PC[lanes[i]] += 2 + 2 * (Vx[lanes[i]] == Vy[lanes[i]]);
+        else
+            unknownOpcode(batch, lanes, n);
+        break;
+    case 0x6:
+        groupAlu(batch, ALU_SET, Vx, Vy, VF, kk, lanes, n);
+        advancePC(batch, lanes, n);
+        break;
+    case 0x7:
+        groupAlu(batch, ALU_ADDI, Vx, Vy, VF, kk, lanes, n);
+        advancePC(batch, lanes, n);
+        break;
+    case 0x8:
+        if (alu8[opcode & 0x000F] >= 0)
+            groupAlu(batch, alu8[opcode & 0x000F], Vx, Vy, VF, 0, lanes, n);
+        else
+            unknownOpcode(batch, lanes, n);
+        advancePC(batch, lanes, n);
+        break;
+    case 0x9:
+        // opcode9 has no case for 9xy0, so it never skips and always
+        // flags the opcode; stay identical
+        unknownOpcode(batch, lanes, n);
+        advancePC(batch, lanes, n);
+        break;
+    case 0xA:
+        for (int i = 0; i < n; ++i)
+            I[lanes[i]] = nnn;
+        advancePC(batch, lanes, n);
+        break;
+    case 0xB:
+        for (int i = 0; i < n; ++i)
+            PC[lanes[i]] = nnn + batch->V[lanes[i]]; // V0 is the first row
+        break;
+    case 0xE:
+        if (kk != 0x9E && kk != 0xA1)
+            goto lanes;
+        // skip when the key's state is the one asked for
+        do {
+            int wanted = kk == 0x9E;
+            for (int i = 0; i < n; ++i) {
+                int l = lanes[i];
+                int pressed = (batch->keys[l] >> (Vx[l] & 0x0F)) & 1;
+                PC[l] += 2 + 2 * (pressed == wanted);
+            }
+        } while (0);
+        break;
+    case 0xF:
+        // the common register-only ones; the rest touch memory or wait
+        switch (kk) {
+        case 0x07:
+            for (int i = 0; i < n; ++i)
+                Vx[lanes[i]] = batch->delay_timer[lanes[i]];
+            break;
+        case 0x15:
+            for (int i = 0; i < n; ++i)
+                batch->delay_timer[lanes[i]] = Vx[lanes[i]];
+            break;
+        case 0x18:
+            for (int i = 0; i < n; ++i)
+                batch->sound_timer[lanes[i]] = Vx[lanes[i]];
+            break;
+        default:
+            goto lanes;
+        }
+        advancePC(batch, lanes, n);
+        break;
+    default:
+    lanes:
+        for (int i = 0; i < n; ++i)
+            laneExec(batch, lanes[i], opcode);
+        break;
+    }
+}
+
+// Sorts the running lanes by PC into batch->order, a counting sort whose
+// buckets are the PCs in use; group g is order[groupStart[g]] up to
+// order[groupStart[g + 1]] and sits at groupPC[g]. Groups come in PC
+// order, so from one cycle to the next the opcodes run in much the same
+// sequence and their branches stay predictable. Returns the number of
+// groups.
+static int groupByPC(chip8_batch_t *batch) {
+    const unsigned char *halted = batch->halted;
+    const unsigned short *PC = batch->PC;
+    unsigned short *groupPC = batch->groupPC;
+    int *groupStart = batch->groupStart;
+    int *bucket = batch->bucket;
+    uint64_t *occupied = batch->occupied;
+    int groups = 0;
+    int first = 0;
+
+    while (first < batch->lanes && halted[first])
+        ++first;
+    if (first == batch->lanes)
+        return 0;
+
+    // lanes in lockstep are common and would queue up on one bucket, so
+    // they are spotted first
+    unsigned short pc = PC[first];
+    int same = 1;
+    for (int l = first; l < batch->lanes; ++l)
+        same &= halted[l] | (PC[l] == pc);
+    if (same) {
+        int n = 0;
+        for (int l = first; l < batch->lanes; ++l)
+            if (!halted[l])
+                batch->order[n++] = l;
+        groupPC[0] = pc & 0x0FFF;
+        groupStart[0] = 0;
+        groupStart[1] = n;
+        return 1;
+    }
+
+    // groups as the lanes first reach them, marked off in the bitmap
+    int lowest = RAMSIZE, highest = 0;
+    for (int l = first; l < batch->lanes; ++l) {
+        if (halted[l])
+            continue;
+        int pc = PC[l] & 0x0FFF;
+        if (bucket[pc]++ == 0) {
+            occupied[pc >> 6] |= (uint64_t) 1 << (pc & 63);
+            lowest = pc < lowest ? pc : lowest;
+            highest = pc > highest ? pc : highest;
+        }
+    }
+
+    // the same in PC order, with the counts turned into the position each
+    // group's lanes go to; the bitmap is left empty
+    int at = 0;
+    for (int w = lowest >> 6; w <= highest >> 6; ++w) {
+        for (uint64_t bits = occupied[w]; bits; bits &= bits - 1) {
+            int pc = w * 64 + __builtin_ctzll(bits);
+            int count = bucket[pc];
+            groupPC[groups] = pc;
+            groupStart[groups++] = at;
+            bucket[pc] = at;
+            at += count;
+        }
+        occupied[w] = 0;
+    }
+    groupStart[groups] = at;
+
+    for (int l = first; l < batch->lanes; ++l)
+        if (!halted[l])
+            batch->order[bucket[PC[l] & 0x0FFF]++] = l;
+
+    // leave the buckets empty for the next cycle
+    for (int g = 0; g < groups; ++g)
+        bucket[groupPC[g]] = 0;
+
+    return groups;
+}
+
+// One chip8_cycle on every lane. Lanes are grouped by PC, and each group
+// runs its opcode together: fetched once when nobody has stored over it,
+// so lanes in lockstep are one group, and lanes that took different
+// branches cost one group each, no pass over the whole batch.
+void chip8_batchCycle(chip8_batch_t *batch) {
+    int stride = batch->stride;
+    unsigned short *op = batch->op;
+    const unsigned char *halted = batch->halted;
+    unsigned char *soundTimer = batch->sound_timer;
+    unsigned char *delayTimer = batch->delay_timer;
+    int groups = groupByPC(batch);
+
+    for (int g = 0; g < groups; ++g) {
+        const int *lanes = batch->order + batch->groupStart[g];
+        int n = batch->groupStart[g + 1] - batch->groupStart[g];
+        int pc = batch->groupPC[g];
+        int next = (pc + 1) & 0x0FFF;
+
+        if (!batch->written[pc] && !batch->written[next]) {
+            const unsigned char *RAM = batch->RAM + (size_t) lanes[0] * RAMSIZE;
+            unsigned short opcode = (RAM[pc] << 8) | RAM[next];
+
+            for (int i = 0; i < n; ++i)
+                op[lanes[i]] = opcode;
+            groupExec(batch, opcode, lanes, n);
+            continue;
+        }
+
+        // self-modified code may differ from lane to lane
+        for (int i = 0; i < n; ++i) {
+            const unsigned char *RAM = batch->RAM + (size_t) lanes[i] * RAMSIZE;
+            op[lanes[i]] = (RAM[pc] << 8) | RAM[next];
+            groupExec(batch, op[lanes[i]], &lanes[i], 1);
+        }
+    }
+
+    // update timers; halted lanes are frozen, like a failed chip8_cycle
+    for (int l = 0; l < stride; ++l) {
+        soundTimer[l] -= (soundTimer[l] > 0) & !halted[l];
+        delayTimer[l] -= (delayTimer[l] > 0) & !halted[l];
+    }
+}
+
+// Sets each lane's keypad from a bitmask (bit k is key k), runs
+// cyclesPerStep cycles and copies each lane's screen into observations,
+// which holds lanes * VRAMSIZE bytes. Either pointer may be NULL.
+void chip8_batchStep(chip8_batch_t *batch, const uint16_t *actions, unsigned char *observations) {
+    if (actions)
+        memcpy(batch->keys, actions, batch->lanes * sizeof(uint16_t));
+
+    for (int i = 0; i < batch->cyclesPerStep; ++i)
+        chip8_batchCycle(batch);
+
+    if (observations)
+        memcpy(observations, batch->VRAM, (size_t) batch->lanes * VRAMSIZE);
+}
@@ -0,0 +1,59 @@
+#ifndef CHIP8_BATCH_H_
+#define CHIP8_BATCH_H_
+
+#include <stdint.h>
+
+#include "chip8.h"
+
+// Lane arrays are padded to a multiple of this so the vector kernels never
+// need a scalar tail
+#define BATCH_LANE_ALIGN 32
+
+// Many copies of one machine, stored structure-of-arrays: entry r of lane
+// l in a per-register array lives at [r * stride + l]. Lanes at the same
+// PC execute together; ALU opcodes run across lanes in AVX2 registers
+// when enough lanes share them, the rest lane by lane.
+typedef struct chip8_batch {
+    int lanes;
+    int stride;
+    int cyclesPerStep;
+
+    unsigned char *V;        // 16 * stride
+    unsigned short *I;       // stride
+    unsigned short *PC;      // stride
+    unsigned short *SP;      // stride
+    unsigned short *stack;   // STACKSIZE * stride
+    unsigned char *delay_timer;
+    unsigned char *sound_timer;
+    uint16_t *keys;          // per lane, bit k is key k
+    unsigned char *halted;   // set on a stack error, the lane stops
+    unsigned char *error;    // per-lane chip8_error, as chip8_t.error
+    unsigned int *rng;       // per-lane Cxkk generator state, as chip8_t.rng
+
+    // per lane and contiguous, so a lane's screen is one observation
+    unsigned char *RAM;      // lanes * RAMSIZE
+    unsigned char *VRAM;     // lanes * VRAMSIZE
+
+    // addresses any lane has stored to since the last reset; code outside
+    // them is still the same in every lane
+    unsigned char written[RAMSIZE];
+
+    // scratch
+    unsigned short *op;
+    unsigned char *mask;
+    int *order;              // running lanes sorted by PC
+    unsigned short *groupPC; // the PC of each run of lanes in order
+    int *groupStart;         // where each run starts, plus the end
+    int bucket[RAMSIZE];     // lanes per PC while sorting, zero otherwise
+    uint64_t occupied[RAMSIZE / 64]; // PCs in use while sorting, likewise
+} chip8_batch_t;
+
+extern chip8_batch_t *chip8_batchNew(int lanes, int cyclesPerStep);
+extern void chip8_batchDestroy(chip8_batch_t *batch);
+extern void chip8_batchReset(chip8_batch_t *batch, const chip8_t *machine);
+extern void chip8_batchSeed(chip8_batch_t *batch, uint32_t seed);
+extern void chip8_batchCycle(chip8_batch_t *batch);
+extern void chip8_batchStep(chip8_batch_t *batch, const uint16_t *actions, unsigned char *observations);
+extern void chip8_batchGetLane(const chip8_batch_t *batch, int lane, chip8_t *machine);
+
+#endif
@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "chip8.h"
+#include "batch.h"
+
+// Times chip8_batchStep against one chip8_cycle loop per lane on a small
+// game loop that polls the keys, moves a sprite and waits on the delay
+// timer. With random actions every lane takes its own branches, which is
+// what a batch of reinforcement learning environments sees. `make bench`
+// runs it.
+#define STEPS 2000
+#define CYCLES_PER_STEP 8
+
+// Each case runs this often and keeps the fastest, so one busy moment on
+// the machine doesn't decide the result
+#define RUNS 3
+
+static const unsigned char game[] = {
+    0x60, 0x20,     // 200  V0 = x
+    0x61, 0x10,     // 202  V1 = y
+    0x62, 0x05,     // 204  loop: key 5 moves right
+    0xE2, 0xA1,     // 206
+    0x70, 0x01,     // 208
+    0x62, 0x07,     // 20A  key 7 moves left
+    0xE2, 0xA1,     // 20C
+    0x70, 0xFF,     // 20E
+    0x62, 0x02,     // 210  key 2 moves up
+    0xE2, 0xA1,     // 212
+    0x71, 0xFF,     // 214
+    0x62, 0x08,     // 216  key 8 moves down
+    0xE2, 0xA1,     // 218
+    0x71, 0x01,     // 21A
+    0x63, 0x3F,     // 21C  keep x and y on the screen
+    0x80, 0x32,     // 21E
+    0x63, 0x1F,     // 220
+    0x81, 0x32,     // 222
+    0x62, 0x0A,     // 224  key A scores
+    0xE2, 0x9E,     // 226
+    0x12, 0x32,     // 228
+    0x74, 0x01,     // 22A  score += 1, carry into V5
+    0x34, 0x00,     // 22C
+    0x12, 0x32,     // 22E
+    0x75, 0x01,     // 230
+    0x00, 0xE0,     // 232  draw the player
+    0xA2, 0x44,     // 234
+    0xD0, 0x14,     // 236
+    0x66, 0x06,     // 238  wait a few ticks
+    0xF6, 0x15,     // 23A
+    0xF6, 0x07,     // 23C
+    0x36, 0x00,     // 23E
+    0x12, 0x3C,     // 240
+    0x12, 0x04,     // 242  again
+    0xF0, 0x90, 0x90, 0xF0  // 244  player sprite
+};
+
+typedef enum { ACTIONS_SAME, ACTIONS_RANDOM } actions_mode;
+
+static uint32_t state = 1;
+
+static uint32_t next(void) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fillActions(uint16_t *actions, int lanes, actions_mode mode) {
+    uint16_t shared = next() & 0xFFFF;
+    for (int l = 0; l < lanes; ++l)
+        actions[l] = mode == ACTIONS_SAME ? shared : next() & 0xFFFF;
+}
+
+// Returns the seconds STEPS steps take on lanes scalar machines
+static double runScalar(const chip8_t *machine, int lanes, actions_mode mode,
+                        unsigned char *observations) {
+    chip8_t *machines = malloc((size_t) lanes * sizeof(chip8_t));
+    uint16_t *actions = malloc(lanes * sizeof(uint16_t));
+    for (int l = 0; l < lanes; ++l)
+        memcpy(&machines[l], machine, sizeof(chip8_t));
+
+    state = 1;
+    double start = now();
+    for (int step = 0; step < STEPS; ++step) {
+        fillActions(actions, lanes, mode);
+        for (int l = 0; l < lanes; ++l) {
+            unsigned char keys[16];
+            for (int k = 0; k < 16; ++k)
+                keys[k] = (actions[l] >> k) & 1;
+            chip8_setKeys(&machines[l], keys);
+
+            for (int c = 0; c < CYCLES_PER_STEP; ++c)
+                chip8_cycle(&machines[l]);
+
+            if (observations)
+                memcpy(observations + (size_t) l * VRAMSIZE, machines[l].VRAM, VRAMSIZE);
+        }
+    }
+    double elapsed = now() - start;
+
+    free(actions);
+    free(machines);
+    return elapsed;
+}
+
+static double runBatch(const chip8_t *machine, int lanes, actions_mode mode,
+                       unsigned char *observations) {
+    chip8_batch_t *batch = chip8_batchNew(lanes, CYCLES_PER_STEP);
+    uint16_t *actions = malloc(lanes * sizeof(uint16_t));
+    chip8_batchReset(batch, machine);
+
+    state = 1;
+    double start = now();
+    for (int step = 0; step < STEPS; ++step) {
+        fillActions(actions, lanes, mode);
+        chip8_batchStep(batch, actions, observations);
+    }
+    double elapsed = now() - start;
+
+    free(actions);
+    chip8_batchDestroy(batch);
+    return elapsed;
+}
+
+int main(void) {
+    static const int laneCounts[] = { 32, 256, 1024 };
+    chip8_t *machine = chip8_new();
+    unsigned char *observations = malloc((size_t) 1024 * VRAMSIZE);
+
+    if (!machine || !observations) {
+        printf("Out of memory\n");
+        return 1;
+    }
+    chip8_init(machine);
+    memcpy(machine->RAM + 0x200, game, sizeof(game));
+
+    printf("%6s  %-7s  %-12s  %10s  %10s  %7s\n",
+           "lanes", "actions", "observations", "scalar ns", "batch ns", "speedup");
+
+    for (int i = 0; i < 3; ++i) {
+        for (int mode = ACTIONS_SAME; mode <= ACTIONS_RANDOM; ++mode) {
+            for (int observe = 0; observe < 2; ++observe) {
+                int lanes = laneCounts[i];
+                unsigned char *obs = observe ? observations : NULL;
+                double scalar = 0, batched = 0;
+                for (int run = 0; run < RUNS; ++run) {
+                    double s = runScalar(machine, lanes, mode, obs);
+                    double b = runBatch(machine, lanes, mode, obs);
+                    scalar = (run == 0 || s < scalar) ? s : scalar;
+                    batched = (run == 0 || b < batched) ? b : batched;
+                }
+                double cycles = (double) STEPS * CYCLES_PER_STEP * lanes;
+
+                // per lane cycle
+                printf("%6d  %-7s  %-12s  %10.2f  %10.2f  %6.2fx\n",
+                       lanes, mode == ACTIONS_SAME ? "same" : "random", observe ? "yes" : "no",
+                       scalar / cycles * 1e9, batched / cycles * 1e9, scalar / batched);
+            }
+        }
+    }
+
+    free(observations);
+    free(machine);
+
+    return 0;
+}
@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+#include "batch.h"
+
+// Runs random programs on a batch and on one scalar machine per lane, with
+// different keys held in every lane, and stops at the first lane whose
+// state differs. `make check` runs it.
+//
+// Jumps, calls and stores into the code send lanes their own ways, so
+// the programs can wander anywhere; chip8_cycle doesn't wrap addresses,
+// so a lane about to fetch or point I past the end of RAM is dropped.
+#define PROGRAMS 50
+#define PROGRAM_LEN 120
+
+// Jump targets stay in the first 2 * PROGRAM_LEN bytes, which every
+// program fills
+#define TARGETS (2 * PROGRAM_LEN)
+#define LANES 100
+#define STEPS 300
+#define CYCLES_PER_STEP 7
+
+static uint32_t state = 7;
+
+static uint32_t next(void) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+static unsigned short randomTarget(void) {
+    return 0x200 + (next() % (TARGETS / 2)) * 2;
+}
+
+static unsigned short randomOpcode(void) {
+    static const unsigned short alu[] = { 0x0, 0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x7, 0xE };
+    static const unsigned short misc[] = { 0x07, 0x0A, 0x15, 0x18, 0x1E, 0x29, 0x33, 0x55, 0x65 };
+    int x = next() % 16;
+    int y = next() % 16;
+    int kk = next() % 256;
+
+    // control flow and opcodes chip8_cycle doesn't know are rarer, or
+    // every program would end in a tight loop or a stuck lane
+    switch (next() % 64) {
+    case 14: case 15: return 0x1000 | randomTarget();
+    case 16: case 17: case 18: return 0x2000 | randomTarget();
+    case 19: case 20: case 21: return 0x00EE;
+    case 22: return 0xB000 | (randomTarget() - (next() % 2) * 0x100);
+    case 23: return 0x9000 | x << 8 | y << 4 | (next() % 16);
+    case 24: return 0x8000 | x << 8 | y << 4 | 0xF;
+    case 25: return 0xE000 | x << 8 | kk;
+    case 26: return 0xF000 | x << 8 | kk;
+    }
+
+    switch (next() % 14) {
+    case 0:  return 0x00E0;
+    case 1:  return 0x3000 | x << 8 | kk;
+    case 2:  return 0x4000 | x << 8 | kk;
+    case 3:  return 0x5000 | x << 8 | y << 4;
+    case 4:  return 0x6000 | x << 8 | kk;
+    case 5:  return 0x7000 | x << 8 | kk;
+    case 6:  return 0x8000 | x << 8 | y << 4 | alu[next() % 9];
+    case 7:  return 0xA400 | kk;
+    case 8:  return 0xC000 | x << 8 | kk;
+    case 9:  return 0xD000 | x << 8 | y << 4 | (next() % 16);
+    case 10: return 0xE09E | x << 8;
+    case 11: return 0xE0A1 | x << 8;
+    default: return 0xF000 | x << 8 | misc[next() % 9];
+    }
+}
+
+static void randomProgram(chip8_t *machine) {
+    unsigned char *rom = machine->RAM + 0x200;
+    int n = 0;
+
+    chip8_init(machine);
+    for (int i = 0; i < PROGRAM_LEN; ++i) {
+        unsigned short opcode = randomOpcode();
+        int kk = opcode & 0x00FF;
+
+        // everything that uses I gets it pointed at 0x400-0x4FF first, so
+        // it stays inside RAM; a quarter of the stores go into the code
+        // just ahead instead, and lanes end up running different programs
+        if ((opcode & 0xF000) == 0xD000 || ((opcode & 0xF000) == 0xF000
+                                            && (kk == 0x1E || kk == 0x29 || kk == 0x33
+                                                || kk == 0x55 || kk == 0x65))) {
+            int target = 0x400 + next() % 0xF0;
+            if ((kk == 0x33 || kk == 0x55) && next() % 4 == 0)
+                target = 0x200 + n + 4 + next() % 8;
+            rom[n++] = 0xA0 | (target >> 8);
+            rom[n++] = target & 0xFF;
+        }
+        rom[n++] = opcode >> 8;
+        rom[n++] = opcode & 0xFF;
+    }
+
+    // spin at the end, twice in case the last opcode skips the first jump
+    for (int i = 0; i < 2; ++i) {
+        int end = 0x200 + n;
+        rom[n++] = 0x10 | (end >> 8);
+        rom[n++] = end & 0xFF;
+    }
+}
+
+// Lanes in step rewrite the instruction they run next with a random byte
+// of their own, so they fetch different opcodes at the same PC
+static void selfModifyingProgram(chip8_t *machine) {
+    static const unsigned char rom[] = {
+        0xC0, 0xFF,     // 200  V0 = random
+        0xA2, 0x07,     // 202  I = 207
+        0xF0, 0x55,     // 204  [207] = V0
+        0x6A, 0x00,     // 206  VA = the byte just stored
+        0x12, 0x00      // 208  again
+    };
+
+    chip8_init(machine);
+    memcpy(machine->RAM + 0x200, rom, sizeof(rom));
+}
+
+static int sameState(const chip8_t *a, const chip8_t *b) {
+    return memcmp(a->V, b->V, sizeof(a->V)) == 0
+        && a->I == b->I && a->PC == b->PC && a->SP == b->SP
+        && memcmp(a->stack, b->stack, sizeof(a->stack)) == 0
+        && a->delay_timer == b->delay_timer && a->sound_timer == b->sound_timer
+        && a->rng == b->rng && a->error == b->error
+        && memcmp(a->RAM, b->RAM, RAMSIZE) == 0
+        && memcmp(a->VRAM, b->VRAM, VRAMSIZE) == 0;
+}
+
+int main(void) {
+    chip8_t *machine = chip8_new();
+    chip8_t *lanes = calloc(LANES, sizeof(chip8_t));
+    chip8_t *lane = chip8_new();
+    chip8_batch_t *batch = chip8_batchNew(LANES, CYCLES_PER_STEP);
+    uint16_t actions[LANES];
+    unsigned char dropped[LANES];
+    long droppedLanes = 0;
+
+    if (!machine || !lanes || !lane || !batch) {
+        printf("Out of memory\n");
+        return 1;
+    }
+
+    for (int p = 0; p < PROGRAMS; ++p) {
+        if (p == 0)
+            selfModifyingProgram(machine);
+        else
+            randomProgram(machine);
+        chip8_batchReset(batch, machine);
+
+        // Cxkk gives every lane its own values while the lanes still run
+        // in step, so their stores into the code differ
+        chip8_batchSeed(batch, p + 1);
+        for (int l = 0; l < LANES; ++l) {
+            memcpy(&lanes[l], machine, sizeof(chip8_t));
+            lanes[l].rng = batch->rng[l];
+        }
+        memset(dropped, 0, LANES);
+
+        for (int step = 0; step < STEPS; ++step) {
+            for (int l = 0; l < LANES; ++l)
+                actions[l] = next() & 0xFFFF;
+
+            chip8_batchStep(batch, actions, NULL);
+
+            for (int l = 0; l < LANES; ++l) {
+                unsigned char keys[16];
+                for (int k = 0; k < 16; ++k)
+                    keys[k] = (actions[l] >> k) & 1;
+                chip8_setKeys(&lanes[l], keys);
+
+                for (int c = 0; c < CYCLES_PER_STEP && !dropped[l]; ++c) {
+                    // the longest reach is Fx55 or a 15 row sprite
+                    if (lanes[l].PC > RAMSIZE - 2 || lanes[l].I > RAMSIZE - 16) {
+                        dropped[l] = 1;
+                        ++droppedLanes;
+                        break;
+                    }
+                    chip8_cycle(&lanes[l]);
+                }
+                if (dropped[l])
+                    continue;
+
+                chip8_batchGetLane(batch, l, lane);
+                if (!sameState(lane, &lanes[l])) {
+                    printf("Program %d diverges at step %d in lane %d: PC %03x/%03x, I %03x/%03x,"
+                           " DT %d/%d, %s/%s\n", p, step, l, lane->PC, lanes[l].PC, lane->I, lanes[l].I,
+                           lane->delay_timer, lanes[l].delay_timer,
+                           chip8_strerror(lane->error), chip8_strerror(lanes[l].error));
+                    return 1;
+                }
+            }
+        }
+    }
+
+    printf("Batch matches chip8_cycle on %d programs x %d lanes x %d cycles"
+           " (%ld lanes left RAM)\n", PROGRAMS, LANES, STEPS * CYCLES_PER_STEP, droppedLanes);
+
+    chip8_batchDestroy(batch);
+    free(lanes);
+    free(lane);
+    free(machine);
+
+    return 0;
+}
@@ -0,0 +1,354 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "capture.h"
+
+// Frames that were still on screen when a capture ended abruptly (no
+// closing record) get this duration
+#define DEFAULT_DELAY_MS 100
+
+static int scale = 4;
+
+/*******************
+ * GIF OUTPUT
+ ******************/
+typedef struct gif_writer {
+    FILE *fp;
+    unsigned char block[255];
+    int blockLen;
+    uint32_t bits;
+    int bitCount;
+} gif_writer_t;
+
+static void gifFlushBlock(gif_writer_t *gif) {
+    if (gif->blockLen) {
+        fputc(gif->blockLen, gif->fp);
+        fwrite(gif->block, 1, gif->blockLen, gif->fp);
+        gif->blockLen = 0;
+    }
+}
+
+static void gifWriteCode(gif_writer_t *gif, int code, int size) {
+    gif->bits |= (uint32_t) code << gif->bitCount;
+    gif->bitCount += size;
+    while (gif->bitCount >= 8) {
+        gif->block[gif->blockLen++] = gif->bits & 0xFF;
+        gif->bits >>= 8;
+        gif->bitCount -= 8;
+        if (gif->blockLen == 255)
+            gifFlushBlock(gif);
+    }
+}
+
+static void writeU16(FILE *fp, int value) {
+    fputc(value & 0xFF, fp);
+    fputc((value >> 8) & 0xFF, fp);
+}
+
+static void gifBegin(gif_writer_t *gif, int width, int height) {
+    static const unsigned char palette[12] = {
+        0x00, 0x00, 0x00,  0xFF, 0xFF, 0xFF,  0x00, 0x00, 0x00,  0x00, 0x00, 0x00
+    };
+
+    fwrite("GIF89a", 1, 6, gif->fp);
+    writeU16(gif->fp, width);
+    writeU16(gif->fp, height);
+    fputc(0xF1, gif->fp); // global colour table of 4 entries
+    fputc(0, gif->fp);
+    fputc(0, gif->fp);
+    fwrite(palette, 1, sizeof(palette), gif->fp);
+
+    // loop forever
+    fwrite("\x21\xFF\x0BNETSCAPE2.0\x03\x01\x00\x00\x00", 1, 19, gif->fp);
+}
+
+// LZW-compresses one full frame. 2 is the smallest code size GIF allows,
+// so the two colours sit in a 4-entry table.
+static void gifFrame(gif_writer_t *gif, const unsigned char *pixels, int width, int height,
+                     int delayCs) {
+    static uint16_t next[4096][4];
+    const int minCodeSize = 2;
+    const int clearCode = 1 << minCodeSize;
+
+    fwrite("\x21\xF9\x04\x00", 1, 4, gif->fp);
+    writeU16(gif->fp, delayCs);
+    fputc(0, gif->fp);
+    fputc(0, gif->fp);
+
+    fputc(0x2C, gif->fp);
+    writeU16(gif->fp, 0);
+    writeU16(gif->fp, 0);
+    writeU16(gif->fp, width);
+    writeU16(gif->fp, height);
+    fputc(0, gif->fp);
+    fputc(minCodeSize, gif->fp);
+
+    memset(next, 0, sizeof(next));
+    int codeSize = minCodeSize + 1;
+    int maxCode = clearCode + 1;
+    int cur = pixels[0];
+
+    gifWriteCode(gif, clearCode, codeSize);
+
+    for (int i = 1; i < width * height; ++i) {
+        int p = pixels[i];
+        if (next[cur][p]) {
+            cur = next[cur][p];
+            continue;
+        }
+
+        gifWriteCode(gif, cur, codeSize);
+        next[cur][p] = ++maxCode;
+        if (maxCode >= (1 << codeSize))
+            ++codeSize;
+        if (maxCode == 4095) {
+            gifWriteCode(gif, clearCode, codeSize);
+            memset(next, 0, sizeof(next));
+            codeSize = minCodeSize + 1;
+            maxCode = clearCode + 1;
+        }
+        cur = p;
+    }
+
+    gifWriteCode(gif, cur, codeSize);
+    gifWriteCode(gif, clearCode, codeSize);
+    gifWriteCode(gif, clearCode + 1, minCodeSize + 1);
+    if (gif->bitCount)
+        gifWriteCode(gif, 0, 8 - gif->bitCount);
+    gifFlushBlock(gif);
+    fputc(0, gif->fp);
+}
+
+/*******************
+ * PNG OUTPUT
+ ******************/
+static uint32_t crcTable[256];
+
+static void initCrc(void) {
+    for (uint32_t n = 0; n < 256; ++n) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; ++k)
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        crcTable[n] = c;
+    }
+}
+
+static uint32_t crc(uint32_t c, const unsigned char *buf, size_t len) {
+    for (size_t i = 0; i < len; ++i)
+        c = crcTable[(c ^ buf[i]) & 0xFF] ^ (c >> 8);
+    return c;
+}
+
+static void writeU32BE(FILE *fp, uint32_t value) {
+    fputc(value >> 24, fp);
+    fputc((value >> 16) & 0xFF, fp);
+    fputc((value >> 8) & 0xFF, fp);
+    fputc(value & 0xFF, fp);
+}
+
+static void pngChunk(FILE *fp, const char *type, const unsigned char *data, size_t len) {
+    writeU32BE(fp, len);
+    fwrite(type, 1, 4, fp);
+    if (len)
+        fwrite(data, 1, len, fp);
+    uint32_t c = crc(0xFFFFFFFFu, (const unsigned char *) type, 4);
+    writeU32BE(fp, crc(c, data, len) ^ 0xFFFFFFFFu);
+}
+
+// Writes an 8-bit greyscale PNG. The zlib stream uses stored blocks only,
+// which keeps the exporter free of dependencies; the images are tiny.
+static int writePng(const char *filename, const unsigned char *pixels, int width, int height) {
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        printf("Can't open %s for writing.\n", filename);
+        return 0;
+    }
+
+    size_t rawLen = (size_t) (width + 1) * height;
+    size_t blocks = rawLen / 65535 + 1;
+    unsigned char *raw = malloc(rawLen);
+    unsigned char *z = malloc(2 + rawLen + blocks * 5 + 4);
+
+    for (int y = 0; y < height; ++y) {
+        raw[y * (width + 1)] = 0; // no filter
+        for (int x = 0; x < width; ++x)
+            raw[y * (width + 1) + 1 + x] = pixels[y * width + x] ? 0xFF : 0x00;
+    }
+
+    size_t zLen = 0;
+    z[zLen++] = 0x78;
+    z[zLen++] = 0x01;
+    for (size_t pos = 0; pos < rawLen; ) {
+        size_t len = rawLen - pos > 65535 ? 65535 : rawLen - pos;
+        z[zLen++] = (pos + len == rawLen) ? 1 : 0;
+        z[zLen++] = len & 0xFF;
+        z[zLen++] = len >> 8;
+        z[zLen++] = ~len & 0xFF;
+        z[zLen++] = (~len >> 8) & 0xFF;
+        memcpy(z + zLen, raw + pos, len);
+        zLen += len;
+        pos += len;
+    }
+
+    uint32_t a = 1, b = 0;
+    for (size_t i = 0; i < rawLen; ++i) {
+        a = (a + raw[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+    uint32_t adler = (b << 16) | a;
+    z[zLen++] = adler >> 24;
+    z[zLen++] = (adler >> 16) & 0xFF;
+    z[zLen++] = (adler >> 8) & 0xFF;
+    z[zLen++] = adler & 0xFF;
+
+    unsigned char ihdr[13] = {
+        width >> 24, (width >> 16) & 0xFF, (width >> 8) & 0xFF, width & 0xFF,
+        height >> 24, (height >> 16) & 0xFF, (height >> 8) & 0xFF, height & 0xFF,
+        8, 0, 0, 0, 0
+    };
+
+    fwrite("\x89PNG\r\n\x1A\n", 1, 8, fp);
+    pngChunk(fp, "IHDR", ihdr, sizeof(ihdr));
+    pngChunk(fp, "IDAT", z, zLen);
+    pngChunk(fp, "IEND", NULL, 0);
+
+    free(raw);
+    free(z);
+    return fclose(fp) == 0;
+}
+
+/*******************
+ * EXPORT
+ ******************/
+static void upscale(const unsigned char *src, int width, int height, unsigned char *dst) {
+    for (int y = 0; y < height * scale; ++y)
+        for (int x = 0; x < width * scale; ++x)
+            dst[y * width * scale + x] = src[(y / scale) * width + x / scale];
+}
+
+static int suffixIs(const char *s, const char *suffix) {
+    size_t n = strlen(s), m = strlen(suffix);
+    return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+/*******************
+ * ENTRY POINT
+ ******************/
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "x:")) != -1) {
+        switch (opt) {
+        case 'x':
+            scale = atoi(optarg);
+            break;
+        default:
+            scale = 0;
+            break;
+        }
+    }
+
+    if (argc - optind < 2 || scale < 1) {
+        printf("Usage: %s [-x SCALE] CAPTURE OUTPUT.gif\n", argv[0]);
+        printf("       %s [-x SCALE] CAPTURE PREFIX   (writes PREFIX-00000.png, ...)\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    const char *output = argv[optind + 1];
+    int asGif = suffixIs(output, ".gif");
+
+    capture_reader_t reader;
+    if (!capture_readerOpen(&reader, argv[optind]))
+        exit(EXIT_FAILURE);
+
+    int width = reader.width * scale;
+    int height = reader.height * scale;
+    size_t frameSize = (size_t) reader.width * reader.height;
+    unsigned char *pending = malloc(frameSize);
+    unsigned char *scaled = malloc((size_t) width * height);
+    int havePending = 0;
+    uint32_t pendingTicks = 0;
+    uint32_t firstTicks = 0;
+    int count = 0;
+
+    // GIF delays are centiseconds: each frame ends at its capture time
+    // rounded on the capture's own clock, so rounding never accumulates,
+    // and a frame that rounds to no time at all is left for the next one
+    // to cover (viewers play a delay of 0 as something like 100 ms)
+    uint32_t gifCs = 0;
+    int folded = 0;
+
+    gif_writer_t gif = { 0 };
+    if (asGif) {
+        gif.fp = fopen(output, "wb");
+        if (!gif.fp) {
+            printf("Can't open %s for writing.\n", output);
+            exit(EXIT_FAILURE);
+        }
+        gifBegin(&gif, width, height);
+    }
+    else {
+        initCrc();
+    }
+
+    // a frame is written once the next record tells us how long it lasted
+    for (;;) {
+        int more = capture_readerNext(&reader);
+
+        if (havePending) {
+            int delay = more ? (int) (reader.ticks - pendingTicks) : DEFAULT_DELAY_MS;
+            if (asGif) {
+                uint32_t endCs = (pendingTicks - firstTicks + delay + 5) / 10;
+                if (endCs > gifCs) {
+                    upscale(pending, reader.width, reader.height, scaled);
+                    gifFrame(&gif, scaled, width, height, endCs - gifCs);
+                    gifCs = endCs;
+                }
+                else {
+                    ++folded;
+                }
+            }
+            else {
+                char name[4096];
+                upscale(pending, reader.width, reader.height, scaled);
+                snprintf(name, sizeof(name), "%s-%05d.png", output, count);
+                if (!writePng(name, scaled, width, height))
+                    exit(EXIT_FAILURE);
+            }
+            ++count;
+            havePending = 0;
+        }
+
+        if (!more)
+            break;
+
+        // the closing record repeats the last frame only to end it
+        if (count > 0 && memcmp(pending, reader.frame, frameSize) == 0)
+            continue;
+
+        memcpy(pending, reader.frame, frameSize);
+        if (count == 0)
+            firstTicks = reader.ticks;
+        pendingTicks = reader.ticks;
+        havePending = 1;
+    }
+
+    if (asGif) {
+        fputc(0x3B, gif.fp);
+        fclose(gif.fp);
+    }
+
+    if (folded)
+        printf("Exported %d frames (%d shorter than 10 ms folded into the next)\n",
+               count - folded, folded);
+    else
+        printf("Exported %d frames\n", count);
+
+    capture_readerClose(&reader);
+    free(pending);
+    free(scaled);
+
+    return 0;
+}
@@ -0,0 +1,272 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include "capture.h"
+
+// Frames go through a single-producer/single-consumer ring: the emulator
+// only ever copies into a free slot and bumps head, the encoder thread
+// owns everything after that, including all of the file I/O.
+struct capture {
+    FILE *fp;
+    int width;
+    int height;
+    size_t frameSize;
+
+    unsigned char *slots;
+    uint32_t slotTicks[CAPTURE_QUEUE_LEN];
+    atomic_uint head;
+    atomic_uint tail;
+    sem_t ready;
+    atomic_int running;
+    pthread_t thread;
+    unsigned long dropped;
+
+    // encoder thread state
+    unsigned char *prev;
+    int haveFrame;
+    uint32_t lastTicks;
+    unsigned long stored;
+    unsigned long duplicates;
+};
+
+static void writeVarint(FILE *fp, uint32_t value) {
+    while (value >= 0x80) {
+        fputc((value & 0x7F) | 0x80, fp);
+        value >>= 7;
+    }
+    fputc(value, fp);
+}
+
+static int readVarint(FILE *fp, uint32_t *value) {
+    uint32_t result = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        int c = fgetc(fp);
+        if (c == EOF)
+            return 0;
+        result |= (uint32_t) (c & 0x7F) << shift;
+        if (!(c & 0x80)) {
+            *value = result;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void writeU16(FILE *fp, int value) {
+    fputc(value & 0xFF, fp);
+    fputc((value >> 8) & 0xFF, fp);
+}
+
+static int readU16(FILE *fp) {
+    int lo = fgetc(fp);
+    int hi = fgetc(fp);
+    return (lo == EOF || hi == EOF) ? -1 : lo | (hi << 8);
+}
+
+// Writes one record for frame, encoded against cap->prev
+static void encodeFrame(capture_t *cap, const unsigned char *frame, uint32_t ticks) {
+    writeVarint(cap->fp, ticks - cap->lastTicks);
+
+    int changed = 0;
+    uint32_t run = 0;
+    for (size_t i = 0; i < cap->frameSize; ++i) {
+        int diff = (frame[i] != 0) != (cap->prev[i] != 0);
+        if (diff != changed) {
+            writeVarint(cap->fp, run);
+            changed = diff;
+            run = 0;
+        }
+        ++run;
+    }
+    writeVarint(cap->fp, run);
+
+    if (frame != cap->prev)
+        memcpy(cap->prev, frame, cap->frameSize);
+    cap->lastTicks = ticks;
+    cap->haveFrame = 1;
+    ++cap->stored;
+}
+
+static void *encoderThread(void *arg) {
+    capture_t *cap = arg;
+
+    for (;;) {
+        sem_wait(&cap->ready);
+
+        unsigned tail = atomic_load_explicit(&cap->tail, memory_order_relaxed);
+        unsigned head = atomic_load_explicit(&cap->head, memory_order_acquire);
+        if (tail == head) {
+            // every push posts once, so an empty queue means we're done
+            if (!atomic_load(&cap->running))
+                break;
+            continue;
+        }
+
+        const unsigned char *frame = cap->slots + (tail % CAPTURE_QUEUE_LEN) * cap->frameSize;
+        uint32_t ticks = cap->slotTicks[tail % CAPTURE_QUEUE_LEN];
+
+        if (cap->haveFrame && memcmp(frame, cap->prev, cap->frameSize) == 0)
+            ++cap->duplicates;
+        else
+            encodeFrame(cap, frame, ticks);
+
+        atomic_store_explicit(&cap->tail, tail + 1, memory_order_release);
+    }
+
+    return NULL;
+}
+
+capture_t *capture_open(const char *filename, int width, int height) {
+    capture_t *cap = calloc(1, sizeof(capture_t));
+    if (!cap)
+        return NULL;
+
+    cap->width = width;
+    cap->height = height;
+    cap->frameSize = (size_t) width * height;
+    cap->slots = malloc(cap->frameSize * CAPTURE_QUEUE_LEN);
+    cap->prev = calloc(1, cap->frameSize);
+    cap->fp = fopen(filename, "wb");
+
+    if (!cap->slots || !cap->prev || !cap->fp) {
+        printf("Could not open capture file %s\n", filename);
+        goto fail;
+    }
+
+    fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_LEN, cap->fp);
+    writeU16(cap->fp, width);
+    writeU16(cap->fp, height);
+
+    atomic_init(&cap->head, 0);
+    atomic_init(&cap->tail, 0);
+    atomic_init(&cap->running, 1);
+    sem_init(&cap->ready, 0, 0);
+
+    if (pthread_create(&cap->thread, NULL, encoderThread, cap) != 0) {
+        printf("Could not start the capture thread\n");
+        sem_destroy(&cap->ready);
+        goto fail;
+    }
+
+    return cap;
+
+fail:
+    if (cap->fp)
+        fclose(cap->fp);
+    free(cap->slots);
+    free(cap->prev);
+    free(cap);
+    return NULL;
+}
+
+// Queues a frame for encoding without ever waiting on the encoder; if the
+// queue is full the frame is dropped and 0 is returned.
+int capture_push(capture_t *cap, const unsigned char *vram, uint32_t ticks) {
+    unsigned head = atomic_load_explicit(&cap->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&cap->tail, memory_order_acquire);
+
+    if (head - tail >= CAPTURE_QUEUE_LEN) {
+        ++cap->dropped;
+        return 0;
+    }
+
+    memcpy(cap->slots + (head % CAPTURE_QUEUE_LEN) * cap->frameSize, vram, cap->frameSize);
+    cap->slotTicks[head % CAPTURE_QUEUE_LEN] = ticks;
+    atomic_store_explicit(&cap->head, head + 1, memory_order_release);
+    sem_post(&cap->ready);
+
+    return 1;
+}
+
+// Drains the queue, stamps the duration of the last frame and closes the file
+int capture_close(capture_t *cap, uint32_t ticks) {
+    atomic_store(&cap->running, 0);
+    sem_post(&cap->ready);
+    pthread_join(cap->thread, NULL);
+    sem_destroy(&cap->ready);
+
+    if (cap->haveFrame)
+        encodeFrame(cap, cap->prev, ticks);
+
+    int success = fclose(cap->fp) == 0;
+
+    printf("Captured %lu frames (%lu duplicates, %lu dropped)\n",
+           cap->stored, cap->duplicates, cap->dropped);
+
+    free(cap->slots);
+    free(cap->prev);
+    free(cap);
+
+    return success;
+}
+
+int capture_readerOpen(capture_reader_t *reader, const char *filename) {
+    char magic[CAPTURE_MAGIC_LEN];
+
+    memset(reader, 0, sizeof(capture_reader_t));
+    reader->fp = fopen(filename, "rb");
+    if (!reader->fp) {
+        printf("Could not open capture file %s\n", filename);
+        return 0;
+    }
+
+    if (fread(magic, 1, CAPTURE_MAGIC_LEN, reader->fp) != CAPTURE_MAGIC_LEN
+        || memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != 0) {
+        printf("%s is not a capture file\n", filename);
+        goto fail;
+    }
+
+    reader->width = readU16(reader->fp);
+    reader->height = readU16(reader->fp);
+    if (reader->width <= 0 || reader->height <= 0) {
+        printf("%s has a corrupt header\n", filename);
+        goto fail;
+    }
+
+    reader->frame = calloc(1, (size_t) reader->width * reader->height);
+    if (!reader->frame)
+        goto fail;
+
+    return 1;
+
+fail:
+    fclose(reader->fp);
+    reader->fp = NULL;
+    return 0;
+}
+
+// Decodes the next record into reader->frame; returns 0 at the end of the
+// file or on a truncated record.
+int capture_readerNext(capture_reader_t *reader) {
+    uint32_t delta, run;
+    size_t size = (size_t) reader->width * reader->height;
+    size_t pos = 0;
+    int changed = 0;
+
+    if (!readVarint(reader->fp, &delta))
+        return 0;
+
+    while (pos < size) {
+        if (!readVarint(reader->fp, &run) || run > size - pos)
+            return 0;
+        if (changed)
+            for (size_t i = pos; i < pos + run; ++i)
+                reader->frame[i] ^= 1;
+        pos += run;
+        changed = !changed;
+    }
+
+    reader->ticks += delta;
+    return 1;
+}
+
+void capture_readerClose(capture_reader_t *reader) {
+    if (reader->fp)
+        fclose(reader->fp);
+    free(reader->frame);
+    reader->fp = NULL;
+    reader->frame = NULL;
+}
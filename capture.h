@@ -0,0 +1,40 @@
+#ifndef CHIP8_CAPTURE_H_
+#define CHIP8_CAPTURE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Capture file layout (all integers little endian):
+//
+//   header:  "CH8CAP" 0x00 0x01, uint16 width, uint16 height
+//   records: varint milliseconds since the previous record, followed by
+//            the frame XORed with the previous one (the first against a
+//            blank screen) as alternating varint run lengths, starting
+//            with a run of unchanged pixels. The runs add up to
+//            width * height.
+//
+// Identical consecutive frames are never stored; the last record is
+// written on close so that the final frame has a duration.
+#define CAPTURE_MAGIC "CH8CAP\0\1"
+#define CAPTURE_MAGIC_LEN 8
+#define CAPTURE_QUEUE_LEN 64
+
+typedef struct capture capture_t;
+
+extern capture_t *capture_open(const char *filename, int width, int height);
+extern int capture_push(capture_t *cap, const unsigned char *vram, uint32_t ticks);
+extern int capture_close(capture_t *cap, uint32_t ticks);
+
+typedef struct capture_reader {
+    FILE *fp;
+    int width;
+    int height;
+    uint32_t ticks;
+    unsigned char *frame;
+} capture_reader_t;
+
+extern int capture_readerOpen(capture_reader_t *reader, const char *filename);
+extern int capture_readerNext(capture_reader_t *reader);
+extern void capture_readerClose(capture_reader_t *reader);
+
+#endif
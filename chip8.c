@@ -1,8 +1,15 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "chip8.h"
 #include "opcodes.h"
 
+// Cxkk sequence of a freshly initialised machine
+#define DEFAULT_SEED 1
+
 chip8_t *chip8_new(void) {
-    chip8_t *machine = malloc(sizeof(chip8_t));
+    chip8_t *machine = calloc(1, sizeof(chip8_t));
     return machine;
 }
 
@@ -34,31 +41,49 @@ int chip8_init(chip8_t *machine) {
     machine->delay_timer = 0;
     machine->sound_timer = 0;
 
+    memset(machine->keys, 0, sizeof(machine->keys));
+    machine->redraw = 0;
+    machine->error = CHIP8_OK;
+    machine->host = NULL;
+    chip8_seed(machine, DEFAULT_SEED);
+
     return 1;
 }
 
+// The host is only good in the process that set it, so chip8_init clears
+// it and it has to be set again after every reset
+void chip8_setHost(chip8_t *machine, const chip8_host_t *host) {
+    machine->host = host;
+}
+
+void chip8_seed(chip8_t *machine, unsigned int seed) {
+    // xorshift gets stuck on 0
+    machine->rng = seed ? seed : DEFAULT_SEED;
+}
+
+// Returns 0 and sets machine->error if the ROM can't be loaded
 int chip8_loadFile(chip8_t *machine, const char *filename) {
     int success = 0;
 
     FILE *fp = fopen(filename, "rb");
     if (!fp) {
-        printf("Could not open file %s\n", filename);
-        goto cleanup;
+        machine->error = CHIP8_ERR_OPEN;
+        return 0;
     }
 
     fseek(fp, 0, SEEK_END);
-    int size = ftell(fp);
+    long size = ftell(fp);
 
-    if (size > RAMSIZE - 0x0200) {
-        printf("The file is %d bytes long, the maximum size is 3584 bytes.\n", size);
+    if (size < 0 || size > RAMSIZE - 0x0200) {
+        machine->error = CHIP8_ERR_TOO_BIG;
         goto cleanup;
     }
 
     fseek(fp, 0, SEEK_SET);
-    int r = fread(machine->RAM + 0x0200, 1, size, fp);
+    long r = fread(machine->RAM + 0x0200, 1, size, fp);
 
     if (r != size) {
-        printf("Could not read file %s\n", filename);
+        machine->error = CHIP8_ERR_READ;
         goto cleanup;
     }
 
@@ -77,8 +102,6 @@ int chip8_loadFile(chip8_t *machine, const char *filename) {
 
     /* machine->RAM[0x0210] = 0x80; */
 
-    printf("Loaded %u bytes\n", size);
-    
     success = 1;
 
 cleanup:
@@ -86,6 +109,17 @@ cleanup:
     return success;
 }
 
+// Same as chip8_loadFile, for a ROM that is already in memory
+int chip8_loadMemory(chip8_t *machine, const unsigned char *rom, size_t size) {
+    if (size > RAMSIZE - 0x0200) {
+        machine->error = CHIP8_ERR_TOO_BIG;
+        return 0;
+    }
+
+    memcpy(machine->RAM + 0x0200, rom, size);
+    return 1;
+}
+
 int chip8_destroy(chip8_t *machine) {
     // nothing to do, really...
     return 1;
@@ -96,7 +130,24 @@ int chip8_draw(chip8_t *machine) {
     return 1;
 }
 
+// Returns 0 once the machine has hit an error it can't continue from;
+// machine->error also reports unknown opcodes, which are skipped.
 int chip8_cycle(chip8_t *machine) {
+    const chip8_host_t *host = machine->host;
+
+    if (machine->error == CHIP8_ERR_STACK_OVERFLOW
+        || machine->error == CHIP8_ERR_STACK_UNDERFLOW) {
+        return 0;
+    }
+
+    int soundWasOn = machine->sound_timer > 0;
+    int redraw = machine->redraw;
+    machine->redraw = 0;
+
+    if (host && host->pollKeys) {
+        host->pollKeys(host->userdata, machine->keys);
+    }
+
     // fetch opcode
     machine->opcode = (machine->RAM[machine->PC] << 8) | (machine->RAM[machine->PC + 1]);
 
@@ -106,11 +157,26 @@ int chip8_cycle(chip8_t *machine) {
     // execute opcode
     opcodes[index](machine);
 
+    // the flag stays up until the host clears it, whoever set it
+    int drew = machine->redraw;
+    machine->redraw |= redraw;
+
     // update timers
     if (machine->sound_timer > 0) { machine->sound_timer--; }
     if (machine->delay_timer > 0) { machine->delay_timer--; }
 
-    return 1;
+    if (host) {
+        int soundIsOn = machine->sound_timer > 0;
+        if (host->sound && soundIsOn != soundWasOn) {
+            host->sound(host->userdata, soundIsOn);
+        }
+        if (host->frameReady && drew) {
+            host->frameReady(host->userdata, machine);
+        }
+    }
+
+    return machine->error != CHIP8_ERR_STACK_OVERFLOW
+        && machine->error != CHIP8_ERR_STACK_UNDERFLOW;
 }
 
 int chip8_decrementTimers(chip8_t *machine) {
@@ -123,3 +189,16 @@ int chip8_setKeys(chip8_t *machine, unsigned char state[16]) {
         machine->keys[i] = state[i];
     return 1;
 }
+
+const char *chip8_strerror(chip8_error error) {
+    switch (error) {
+    case CHIP8_OK:                  return "No error";
+    case CHIP8_ERR_OPEN:            return "Could not open file";
+    case CHIP8_ERR_TOO_BIG:         return "The file is too long, the maximum size is 3584 bytes";
+    case CHIP8_ERR_READ:            return "Could not read file";
+    case CHIP8_ERR_UNKNOWN_OPCODE:  return "Unknown opcode";
+    case CHIP8_ERR_STACK_OVERFLOW:  return "Stack overflow";
+    case CHIP8_ERR_STACK_UNDERFLOW: return "Stack underflow";
+    }
+    return "Unknown error";
+}
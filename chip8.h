@@ -1,16 +1,7 @@
 #ifndef CHIP8_H_
 #define CHIP8_H_
 
-#include <SDL2/SDL.h>
-#include <SDL2/SDL_image.h>
-#include <SDL2/SDL_mixer.h>
-
-extern SDL_Window* gWindow;
-
-extern SDL_Renderer* gRenderer;
-
-extern Mix_Chunk *gSfx[72];
-extern int gMaxSfx;
+#include <stddef.h>
 
 #define RAMSIZE 4 * 1024
 #define VRAMSIZE 64 * 32
@@ -20,6 +11,28 @@ extern int gMaxSfx;
 #define CHIP8_HEIGHT 32
 #define FONTBASEADDR 0x050
 
+typedef enum {
+    CHIP8_OK = 0,
+    CHIP8_ERR_OPEN,
+    CHIP8_ERR_TOO_BIG,
+    CHIP8_ERR_READ,
+    CHIP8_ERR_UNKNOWN_OPCODE,
+    CHIP8_ERR_STACK_OVERFLOW,
+    CHIP8_ERR_STACK_UNDERFLOW
+} chip8_error;
+
+struct chip8;
+
+// Hooks into whatever is hosting the machine; any of them may be NULL.
+// pollKeys runs before every cycle, sound when the buzzer starts or stops,
+// and frameReady after any cycle that changed the screen.
+typedef struct chip8_host {
+    void *userdata;
+    void (*frameReady)(void *userdata, const struct chip8 *machine);
+    void (*sound)(void *userdata, int on);
+    void (*pollKeys)(void *userdata, unsigned char keys[16]);
+} chip8_host_t;
+
 typedef struct chip8 {
     unsigned short opcode;
     unsigned char RAM[RAMSIZE];
@@ -33,16 +46,23 @@ typedef struct chip8 {
     unsigned short SP;
     unsigned char keys[16];
     unsigned char redraw;
+    unsigned int rng;
+    chip8_error error;
+    const chip8_host_t *host;
 } chip8_t;
 
 extern chip8_t *chip8_new(void);
 extern int chip8_init(chip8_t *machine);
+extern void chip8_setHost(chip8_t *machine, const chip8_host_t *host);
+extern void chip8_seed(chip8_t *machine, unsigned int seed);
 extern int chip8_loadFile(chip8_t *machine, const char *filename);
+extern int chip8_loadMemory(chip8_t *machine, const unsigned char *rom, size_t size);
 extern int chip8_destroy(chip8_t *machine);
 extern int chip8_draw(chip8_t *machine);
 extern int chip8_cycle(chip8_t *machine);
 extern int chip8_decrementTimers(chip8_t *machine);
 extern int chip8_setKeys(chip8_t *machine, unsigned char state[16]);
+extern const char *chip8_strerror(chip8_error error);
 
-extern unsigned char chip8_fontset[80];
+extern const unsigned char chip8_fontset[80];
 #endif
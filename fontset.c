@@ -1,4 +1,6 @@
-unsigned char chip8_fontset[80] =
+#include "chip8.h"
+
+const unsigned char chip8_fontset[80] =
 { 
   0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
   0x20, 0x60, 0x20, 0x20, 0x70, // 1
@@ -6,6 +6,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include <float.h>
 #include <unistd.h>
 
@@ -14,6 +15,11 @@
 #include <SDL2/SDL_mixer.h>
 
 #include "chip8.h"
+#include "scaler.h"
+#include "capture.h"
+#include "shmexport.h"
+#include "telemetry.h"
+#include "trace.h"
 
 //Screen dimension constants
 #define SCREEN_WIDTH 640
@@ -21,6 +27,16 @@
 #define SCREEN_FPS 500
 #define SCREEN_TICKS_PER_FRAME (1000 / SCREEN_FPS)
 
+// -a counts frames of a 60 Hz display, each of which is this many cycles
+#define DISPLAY_FPS 60
+#define CYCLES_PER_DISPLAY_FRAME ((SCREEN_FPS + DISPLAY_FPS / 2) / DISPLAY_FPS)
+
+// How many runAhead() calls pass between adjustments of gAheadCycles
+#define RUNAHEAD_SETTLE 16
+
+// How often the overlay is redrawn when the game screen isn't changing
+#define OVERLAY_REFRESH_US 100000
+
 typedef enum {
     GAME
 } machine_modes;
@@ -33,12 +49,74 @@ int init();
 //Frees media and shuts down SDL
 void myclose();
 
+//Switches the upscaler, recreating the screen texture to match
+int setScaler(scaler_mode mode);
+
+//Upscales the VRAM into the screen texture
+void render(chip8_t *machine);
+
+//Puts the screen texture (and the overlay, if enabled) in the window
+void show();
+
+//Draws the telemetry overlay
+void drawOverlay();
+
+//Draws a decimal number with the CHIP-8 font
+void drawNumber(int x, int y, unsigned long value, int scale);
+
+//Microseconds from an arbitrary start
+Uint64 nowUs();
+
+//Runs a copy of the machine gAheadCycles cycles ahead, returns it
+chip8_t *runAhead(chip8_t *machine, Uint64 budgetUs);
+
+//Host callback, fills in the CHIP-8 keypad from the keyboard
+void pollKeys(void *userdata, unsigned char keys[16]);
+
+//Restarts the machine with the ROM reloaded from filename
+void reset(chip8_t *machine, const char *filename);
+
+const chip8_host_t gHost = { NULL, NULL, NULL, pollKeys };
+
 //The window we'll be rendering to
 SDL_Window* gWindow = NULL;
 
 //The window renderer
 SDL_Renderer* gRenderer = NULL;
 
+// Streaming texture the upscaler writes into, and where it goes on screen
+SDL_Texture* gScreen = NULL;
+SDL_Rect gScreenRect;
+scaler_mode gScaler = SCALER_NEAREST;
+
+// Start fullscreen at the desktop resolution (-f) instead of in a window
+int gFullscreen = 0;
+
+// Session recording, when enabled with -c
+capture_t *gCapture = NULL;
+
+// Run-ahead: the machine shown on screen is a copy of the real one that
+// has been run further with the current input. gRunAhead is what -a asked
+// for, in display frames; gAheadCycles is how far the copy actually runs,
+// which is lowered while the extra emulation doesn't fit in the frame and
+// raised again once it does.
+int gRunAhead = 0;
+int gAheadCycles = 0;
+double gAheadUs = 0;
+int gAheadSettle = 0;
+chip8_t gAhead;
+
+// Shared memory export, when enabled with -m; the machine then lives in it
+shmexport_t *gShm = NULL;
+
+// Instruction trace, when enabled with -T
+trace_t *gTrace = NULL;
+
+// Frame pacing statistics, shown with F3 and written out with -t
+telemetry_t gTelemetry;
+int gOverlay = 0;
+Uint64 gLastShown = 0;
+
 // Sound effects, not sure about the limit yet
 Mix_Chunk *gSfx[72] = { NULL };
 int gMaxSfx = -1;
@@ -52,18 +130,20 @@ int init() {
         return 0;
     }
 
-    if (!SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "1")) {
-        printf("Warning: Linear texture filtering not enabled!");
-    }
-
-    /* if (!SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "0")) { */
+    /* if (!SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "1")) { */
     /*     printf("Warning: Linear texture filtering not enabled!"); */
     /* } */
 
+    // the upscaler already produces the final image, keep it crisp
+    if (!SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "0")) {
+        printf("Warning: Nearest texture filtering not enabled!");
+    }
+
     gWindow = SDL_CreateWindow("CHIP-8",
                                 SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
                                 SCREEN_WIDTH, SCREEN_HEIGHT,
-                                SDL_WINDOW_SHOWN);
+                                SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE
+                                | (gFullscreen ? SDL_WINDOW_FULLSCREEN_DESKTOP : 0));
 
     if (gWindow == NULL) {
         printf("Window could not be created! SDL Error: %s\n", SDL_GetError());
@@ -78,7 +158,9 @@ int init() {
 
     SDL_SetRenderDrawColor(gRenderer, 0xFF, 0xFF, 0xFF, 0xFF);
 
-    SDL_RenderSetLogicalSize(gRenderer, CHIP8_WIDTH, CHIP8_HEIGHT);
+    if (!setScaler(gScaler)) {
+        return 0;
+    }
 
     int imgFlags = IMG_INIT_PNG;
     if (!(IMG_Init(imgFlags) & imgFlags)) {
@@ -94,6 +176,229 @@ int init() {
     return 1;
 }
 
+int setScaler(scaler_mode mode) {
+    int outputWidth, outputHeight;
+    if (SDL_GetRendererOutputSize(gRenderer, &outputWidth, &outputHeight) < 0) {
+        outputWidth = SCREEN_WIDTH;
+        outputHeight = SCREEN_HEIGHT;
+    }
+
+    int maxFactor = outputWidth / CHIP8_WIDTH;
+    if (outputHeight / CHIP8_HEIGHT < maxFactor) {
+        maxFactor = outputHeight / CHIP8_HEIGHT;
+    }
+    int factor = scaler_fitFactor(mode, maxFactor);
+
+    SDL_Texture *texture = SDL_CreateTexture(gRenderer, SDL_PIXELFORMAT_ARGB8888,
+                                             SDL_TEXTUREACCESS_STREAMING,
+                                             CHIP8_WIDTH * factor, CHIP8_HEIGHT * factor);
+    if (texture == NULL) {
+        printf("Screen texture could not be created! SDL Error: %s\n", SDL_GetError());
+        return 0;
+    }
+
+    if (gScreen) {
+        SDL_DestroyTexture(gScreen);
+    }
+    gScreen = texture;
+    gScaler = mode;
+
+    // centre the image when the factor doesn't fill the window exactly
+    gScreenRect.w = CHIP8_WIDTH * factor;
+    gScreenRect.h = CHIP8_HEIGHT * factor;
+    gScreenRect.x = (outputWidth - gScreenRect.w) / 2;
+    gScreenRect.y = (outputHeight - gScreenRect.h) / 2;
+
+    return 1;
+}
+
+void render(chip8_t *machine) {
+    void *pixels;
+    int pitch;
+
+    if (gCapture) {
+        capture_push(gCapture, machine->VRAM, SDL_GetTicks());
+    }
+
+    if (SDL_LockTexture(gScreen, NULL, &pixels, &pitch) == 0) {
+        scaler_run(gScaler, machine->VRAM, CHIP8_WIDTH, CHIP8_HEIGHT,
+                   pixels, pitch, gScreenRect.w / CHIP8_WIDTH);
+        SDL_UnlockTexture(gScreen);
+    }
+}
+
+void show() {
+    SDL_SetRenderDrawColor(gRenderer, 0, 0, 0, 255);
+    SDL_RenderClear(gRenderer);
+    SDL_RenderCopy(gRenderer, gScreen, NULL, &gScreenRect);
+    if (gOverlay) {
+        drawOverlay();
+    }
+    SDL_RenderPresent(gRenderer);
+    gLastShown = nowUs();
+}
+
+// A bar per recent frame showing its work before the throttle sleep (red
+// when that overran the budget, which is what missed deadlines counts; the
+// yellow line is the budget) and below it instructions per second,
+// presented frames per second and missed deadlines, in that order
+void drawOverlay() {
+    const int scale = 3;
+    const int barWidth = 2;
+    const int graphHeight = 60;
+    const Uint64 budget = gTelemetry.budgetUs;
+
+    SDL_Rect backdrop = { 0, 0, TELEMETRY_RECENT * barWidth + 8, graphHeight + 3 * 6 * scale + 12 };
+    SDL_SetRenderDrawBlendMode(gRenderer, SDL_BLENDMODE_BLEND);
+    SDL_SetRenderDrawColor(gRenderer, 0, 0, 0, 192);
+    SDL_RenderFillRect(gRenderer, &backdrop);
+
+    for (int i = 0; i < TELEMETRY_RECENT; ++i) {
+        Uint64 us = gTelemetry.recent[(gTelemetry.recentPos + i) % TELEMETRY_RECENT];
+        int height = us * graphHeight / (2 * budget);
+        if (height > graphHeight) {
+            height = graphHeight;
+        }
+
+        SDL_Rect bar = { 4 + i * barWidth, 4 + graphHeight - height, barWidth, height };
+        if (us > budget) {
+            SDL_SetRenderDrawColor(gRenderer, 0xFF, 0x40, 0x40, 0xFF);
+        }
+        else {
+            SDL_SetRenderDrawColor(gRenderer, 0x40, 0xFF, 0x40, 0xFF);
+        }
+        SDL_RenderFillRect(gRenderer, &bar);
+    }
+
+    SDL_Rect line = { 4, 4 + graphHeight / 2, TELEMETRY_RECENT * barWidth, 1 };
+    SDL_SetRenderDrawColor(gRenderer, 0xFF, 0xFF, 0x40, 0xFF);
+    SDL_RenderFillRect(gRenderer, &line);
+
+    SDL_SetRenderDrawColor(gRenderer, 0xFF, 0xFF, 0xFF, 0xFF);
+    int y = graphHeight + 8;
+    drawNumber(4, y, (unsigned long) gTelemetry.ips, scale);
+    y += 6 * scale;
+    drawNumber(4, y, (unsigned long) gTelemetry.fps, scale);
+    y += 6 * scale;
+    drawNumber(4, y, (unsigned long) gTelemetry.missedDeadlines, scale);
+
+    SDL_SetRenderDrawBlendMode(gRenderer, SDL_BLENDMODE_NONE);
+}
+
+void drawNumber(int x, int y, unsigned long value, int scale) {
+    char digits[24];
+    int n = snprintf(digits, sizeof(digits), "%lu", value);
+
+    for (int i = 0; i < n; ++i) {
+        const unsigned char *glyph = chip8_fontset + (digits[i] - '0') * 5;
+        for (int row = 0; row < 5; ++row) {
+            for (int col = 0; col < 4; ++col) {
+                if (glyph[row] & (0x80 >> col)) {
+                    SDL_Rect pixel = { x + (i * 5 + col) * scale, y + row * scale, scale, scale };
+                    SDL_RenderFillRect(gRenderer, &pixel);
+                }
+            }
+        }
+    }
+}
+
+Uint64 nowUs() {
+    Uint64 counter = SDL_GetPerformanceCounter();
+    Uint64 frequency = SDL_GetPerformanceFrequency();
+
+    // counter * 1000000 would overflow after a few hours of a nanosecond
+    // counter, so convert whole seconds and the remainder separately
+    return counter / frequency * 1000000 + counter % frequency * 1000000 / frequency;
+}
+
+chip8_t *runAhead(chip8_t *machine, Uint64 budgetUs) {
+    Uint64 start = nowUs();
+
+    // the machine is a flat struct, so this is the whole clone
+    memcpy(&gAhead, machine, sizeof(chip8_t));
+    // headless: it keeps the keys it was copied with
+    chip8_setHost(&gAhead, NULL);
+
+    for (int i = 0; i < gAheadCycles; ++i) {
+        chip8_cycle(&gAhead);
+    }
+
+    // the cost is smoothed so that one preemption doesn't count, and the
+    // smoothing gets time to catch up between adjustments
+    gAheadUs += ((double) (nowUs() - start) - gAheadUs) / RUNAHEAD_SETTLE;
+    if (gAheadSettle > 0) {
+        --gAheadSettle;
+    }
+    else if (gAheadUs > budgetUs / 2 && gAheadCycles > 0) {
+        // back off, the rest of the frame needs the room
+        --gAheadCycles;
+        gAheadSettle = RUNAHEAD_SETTLE;
+    }
+    else if (gAheadUs < budgetUs / 4 && gAheadCycles < gRunAhead * CYCLES_PER_DISPLAY_FRAME) {
+        ++gAheadCycles;
+        gAheadSettle = RUNAHEAD_SETTLE;
+    }
+
+    return &gAhead;
+}
+
+void pollKeys(void *userdata, unsigned char keys[16]) {
+    const Uint8 *state = SDL_GetKeyboardState(NULL);
+
+    memset(keys, 0, 16);
+
+    if (state[SDL_SCANCODE_1]) { keys[0x1] = 1; }
+    if (state[SDL_SCANCODE_2]) { keys[0x2] = 1; }
+    if (state[SDL_SCANCODE_3]) { keys[0x3] = 1; }
+    if (state[SDL_SCANCODE_4]) { keys[0xC] = 1; }
+
+    if (state[SDL_SCANCODE_Q]) { keys[0x4] = 1; }
+    if (state[SDL_SCANCODE_W]) { keys[0x5] = 1; }
+    if (state[SDL_SCANCODE_E]) { keys[0x6] = 1; }
+    if (state[SDL_SCANCODE_R]) { keys[0xD] = 1; }
+
+    if (state[SDL_SCANCODE_A]) { keys[0x7] = 1; }
+    if (state[SDL_SCANCODE_S]) { keys[0x8] = 1; }
+    if (state[SDL_SCANCODE_D]) { keys[0x9] = 1; }
+    if (state[SDL_SCANCODE_F]) { keys[0xE] = 1; }
+
+    if (state[SDL_SCANCODE_Z]) { keys[0xA] = 1; }
+    if (state[SDL_SCANCODE_X]) { keys[0x0] = 1; }
+    if (state[SDL_SCANCODE_C]) { keys[0xB] = 1; }
+    if (state[SDL_SCANCODE_V]) { keys[0xF] = 1; }
+
+    // keys held by an external process count as pressed too
+    if (gShm) {
+        unsigned char injected[16] = { 0 };
+        shmexport_readKeys(gShm, injected);
+        for (int i = 0; i < 16; ++i) {
+            keys[i] |= injected[i];
+        }
+    }
+}
+
+void reset(chip8_t *machine, const char *filename) {
+    // the ROM is read into a fresh machine first, so that shared memory
+    // readers are only locked out for the copy and not the disk I/O
+    chip8_t *fresh = chip8_new();
+    if (!fresh) {
+        printf("Out of memory, not resetting\n");
+        return;
+    }
+
+    chip8_init(fresh);
+    chip8_setHost(fresh, &gHost);
+    if (!chip8_loadFile(fresh, filename)) {
+        printf("%s: %s\n", filename, chip8_strerror(fresh->error));
+    }
+
+    if (gShm) { shmexport_beginWrite(gShm); }
+    memcpy(machine, fresh, sizeof(chip8_t));
+    if (gShm) { shmexport_endWrite(gShm); }
+
+    free(fresh);
+}
+
 // NOTE that if you create a close() function, SDL_Init() will hang and never succeed :-)
 // (because you are shadowing the standard library's close())
 void myclose() {
@@ -105,6 +410,10 @@ void myclose() {
     }
 
     //Destroy window
+    if (gScreen) {
+        SDL_DestroyTexture(gScreen);
+        gScreen = NULL;
+    }
     SDL_DestroyRenderer(gRenderer);
     SDL_DestroyWindow(gWindow);
     gWindow = NULL;
@@ -117,36 +426,113 @@ void myclose() {
 }
 
 int main(int argc, char* argv[]) {
-    if (argc < 2) {
+    const char *captureFile = NULL;
+    const char *shmName = NULL;
+    const char *statsFile = NULL;
+    const char *traceFile = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:fc:a:m:t:T:")) != -1) {
+        switch (opt) {
+        case 's':
+            if (scaler_fromName(optarg) < 0) {
+                printf("Unknown scaler %s (use nearest, scale2x, scale3x or xbr)\n", optarg);
+                return 1;
+            }
+            gScaler = scaler_fromName(optarg);
+            break;
+        case 'f':
+            gFullscreen = 1;
+            break;
+        case 'c':
+            captureFile = optarg;
+            break;
+        case 'a':
+            gRunAhead = atoi(optarg);
+            if (gRunAhead < 0) {
+                gRunAhead = 0;
+            }
+            gAheadCycles = gRunAhead * CYCLES_PER_DISPLAY_FRAME;
+            break;
+        case 'm':
+            shmName = optarg;
+            break;
+        case 't':
+            statsFile = optarg;
+            break;
+        case 'T':
+            traceFile = optarg;
+            break;
+        default:
+            printf("Usage: %s [-s scaler] [-f] [-c capturefile] [-a runaheadframes] [-m shmname] [-t statsfile] [-T tracefile] FILENAME\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind >= argc) {
         printf("You must provide a filename\n");
         return 1;
     }
 
-    const char *filename = argv[1];
-    chip8_t *machine = chip8_new();
+    const char *filename = argv[optind];
+    chip8_t *machine = NULL;
+    if (shmName) {
+        gShm = shmexport_create(shmName);
+        if (!gShm) {
+            printf("Could not create shared memory %s: %s\n", shmName, strerror(errno));
+            return 1;
+        }
+        machine = &gShm->machine;
+        shmexport_beginWrite(gShm);
+    }
+    else {
+        machine = chip8_new();
+    }
+
     chip8_init(machine);
-    chip8_loadFile(machine, filename);
+    chip8_setHost(machine, &gHost);
+    if (!chip8_loadFile(machine, filename)) {
+        printf("%s: %s\n", filename, chip8_strerror(machine->error));
+    }
+
+    if (gShm) {
+        shmexport_endWrite(gShm);
+    }
 
     // Start up SDL and create window
     if (!init()) {
         printf("Failed to initialize!\n");
     }
     else {
+        if (captureFile) {
+            gCapture = capture_open(captureFile, CHIP8_WIDTH, CHIP8_HEIGHT);
+        }
+        if (traceFile) {
+            gTrace = trace_open(traceFile);
+        }
+
         // Main loop flag
         int quit = 0;
 
+        telemetry_init(&gTelemetry, SCREEN_TICKS_PER_FRAME * 1000, nowUs());
+        if (statsFile) {
+            telemetry_openStats(&gTelemetry, statsFile, 0);
+        }
+
         // Event handler
         SDL_Event e;
-        const Uint8 *state = SDL_GetKeyboardState(NULL);
 
-        // Start counting frames per second
-        int countedFrames = 0;
+        // set when the window needs the screen again without the machine
+        // having drawn anything; the first frame shows the blank screen
+        int refresh = 1;
 
         // While application is running
         while (!quit)
         {
             int startFrame = SDL_GetTicks();
-            unsigned char keys[16] = { 0 };
+            Uint64 frameStart = nowUs();
+            int executed = 0;
+            int presented = 0;
 
             // NOTE that only game mode is implemented for now
             if (machine_mode == GAME) {
@@ -156,15 +542,41 @@ int main(int argc, char* argv[]) {
                     if (e.type == SDL_QUIT) {
                         quit = 1;
                     }
+                    else if (e.type == SDL_WINDOWEVENT) {
+                        switch (e.window.event) {
+                        case SDL_WINDOWEVENT_SIZE_CHANGED:
+                            // refit the texture to the new output size
+                            setScaler(gScaler);
+                            refresh = 1;
+                            break;
+                        case SDL_WINDOWEVENT_EXPOSED:
+                        case SDL_WINDOWEVENT_RESTORED:
+                            refresh = 1;
+                            break;
+                        default:
+                            break;
+                        }
+                    }
                     else if (e.type == SDL_KEYDOWN) {
                         switch (e.key.keysym.sym) {
                         case SDLK_ESCAPE:
                             quit = 1;
                             break;
+                        case SDLK_F3:
+                            // show the change right away, in particular
+                            // take the overlay off the screen
+                            gOverlay = !gOverlay;
+                            refresh = 1;
+                            break;
+                        case SDLK_F1:
+                            // cycle through the upscalers
+                            setScaler((gScaler + 1) % SCALER_MODES);
+                            printf("Scaler: %s\n", scaler_name(gScaler));
+                            refresh = 1;
+                            break;
                         case SDLK_r:
                             if (e.key.keysym.mod & KMOD_CTRL) {
-                                chip8_init(machine);
-                                chip8_loadFile(machine, filename);
+                                reset(machine, filename);
                             }
                             break;
                         default:
@@ -173,65 +585,107 @@ int main(int argc, char* argv[]) {
                     }
                 }
 
-                // get keys
-                if (state[SDL_SCANCODE_1]) { keys[0x1] = 1; }
-                if (state[SDL_SCANCODE_2]) { keys[0x2] = 1; }
-                if (state[SDL_SCANCODE_3]) { keys[0x3] = 1; }
-                if (state[SDL_SCANCODE_4]) { keys[0xC] = 1; }
-                
-                if (state[SDL_SCANCODE_Q]) { keys[0x4] = 1; }
-                if (state[SDL_SCANCODE_W]) { keys[0x5] = 1; }
-                if (state[SDL_SCANCODE_E]) { keys[0x6] = 1; }
-                if (state[SDL_SCANCODE_R]) { keys[0xD] = 1; }
-                
-                if (state[SDL_SCANCODE_A]) { keys[0x7] = 1; }
-                if (state[SDL_SCANCODE_S]) { keys[0x8] = 1; }
-                if (state[SDL_SCANCODE_D]) { keys[0x9] = 1; }
-                if (state[SDL_SCANCODE_F]) { keys[0xE] = 1; }
-                
-                if (state[SDL_SCANCODE_Z]) { keys[0xA] = 1; }
-                if (state[SDL_SCANCODE_X]) { keys[0x0] = 1; }
-                if (state[SDL_SCANCODE_C]) { keys[0xB] = 1; }
-                if (state[SDL_SCANCODE_V]) { keys[0xF] = 1; }
-
-                chip8_setKeys(machine, keys);
-
-                // run code
-                chip8_cycle(machine);
+                if (gShm) {
+                    shmexport_beginWrite(gShm);
+                }
+
+                // run code (the keys are polled through gHost)
+                int running = gTrace ? trace_step(gTrace, machine) : chip8_cycle(machine);
+                executed = running;
+
+                // clearing the error changes the machine, so it goes in the
+                // same bracket as the cycle
+                int unknownOpcode = running && machine->error == CHIP8_ERR_UNKNOWN_OPCODE;
+                if (unknownOpcode) {
+                    machine->error = CHIP8_OK;
+                }
+
+                if (gShm) {
+                    shmexport_endWrite(gShm);
+                }
+
+                if (!running) {
+                    printf("%s at %04x, stopping\n", chip8_strerror(machine->error), machine->PC);
+                    quit = 1;
+                }
+                else if (unknownOpcode) {
+                    printf("Unknown opcode %4x\n", machine->opcode);
+                }
+
+                // show where the machine will be a few frames from now,
+                // so input shows up without waiting for the ROM to poll it
+                chip8_t *shown = machine;
+                if (gRunAhead > 0) {
+                    shown = runAhead(machine, SCREEN_TICKS_PER_FRAME * 1000);
+                }
+
+                Uint64 emulated = nowUs();
+                telemetry_record(&gTelemetry, TELEMETRY_EMULATE, emulated - frameStart);
 
                 // refresh the display if necessary
-                if (machine->redraw) {
-                    // Clear screen
-                    SDL_SetRenderDrawColor(gRenderer, 0, 0, 0, 255);
-                    SDL_RenderClear(gRenderer);
-
-                    SDL_SetRenderDrawColor(gRenderer, 255, 255, 255, 255);
-                    for (int i = 0; i < CHIP8_HEIGHT; ++i)
-                        for (int j = 0; j < CHIP8_WIDTH; ++j)
-                            if (machine->VRAM[i * CHIP8_WIDTH + j])
-                                SDL_RenderDrawPoint(gRenderer, j, i);
+                if (shown->redraw) {
+                    render(shown);
+                    if (gShm) { shmexport_beginWrite(gShm); }
                     machine->redraw = 0;
+                    if (gShm) { shmexport_endWrite(gShm); }
+                    presented = 1;
+                }
+                else if (refresh) {
+                    render(shown);
                 }
 
-            }
+                Uint64 rendered = nowUs();
+                telemetry_record(&gTelemetry, TELEMETRY_RENDER, rendered - emulated);
 
-            // Update screen
-            SDL_RenderPresent(gRenderer);
-            ++countedFrames;
+                // the overlay keeps updating while the game screen is still
+                if (presented || refresh
+                    || (gOverlay && rendered - gLastShown >= OVERLAY_REFRESH_US)) {
+                    show();
+                }
+                refresh = 0;
+
+                telemetry_record(&gTelemetry, TELEMETRY_PRESENT, nowUs() - rendered);
+            }
 
             // decrement timers at 60Hz
 
             // Throttle
+            Uint64 workUs = nowUs() - frameStart;
             int frameTicks = SDL_GetTicks() - startFrame;
             if (frameTicks < SCREEN_TICKS_PER_FRAME) {
+                Uint64 sleepStart = nowUs();
                 SDL_Delay(SCREEN_TICKS_PER_FRAME - frameTicks);
+                telemetry_sleep(&gTelemetry, (SCREEN_TICKS_PER_FRAME - frameTicks) * 1000,
+                                nowUs() - sleepStart);
             }
+
+            Uint64 frameEnd = nowUs();
+            telemetry_endFrame(&gTelemetry, workUs, frameEnd - frameStart,
+                               executed, presented, frameEnd);
         }
+
+        telemetry_close(&gTelemetry, nowUs());
+    }
+
+    if (gCapture) {
+        capture_close(gCapture, SDL_GetTicks());
+        gCapture = NULL;
+    }
+
+    if (gTrace) {
+        trace_close(gTrace);
+        gTrace = NULL;
     }
 
     // Free resources and close SDL
     chip8_destroy(machine);
-    free(machine);
+    if (gShm) {
+        shmexport_destroy(gShm, shmName);
+        gShm = NULL;
+    }
+    else {
+        free(machine);
+    }
 
     myclose();
 
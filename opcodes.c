@@ -1,9 +1,10 @@
 #include <assert.h>
+#include <string.h>
 
 #include "chip8.h"
 #include "opcodes.h"
 
-void opcode0(chip8_t *machine) {
+static void opcode0(chip8_t *machine) {
     switch (machine->opcode) {
     case 0x00E0:
         // clear the display
@@ -12,6 +13,10 @@ void opcode0(chip8_t *machine) {
         break;
     case 0x00EE:
         // return from a subroutine
+        if (machine->SP == 0) {
+            machine->error = CHIP8_ERR_STACK_UNDERFLOW;
+            return;
+        }
         machine->SP--;
         machine->PC = machine->stack[machine->SP];
         return;
@@ -24,25 +29,25 @@ void opcode0(chip8_t *machine) {
     machine->PC += 2;
 }
 
-void opcode1(chip8_t *machine) {
+static void opcode1(chip8_t *machine) {
     // Jump to location nnn
     machine->PC = machine->opcode & 0x0FFF;
 }
 
-void opcode2(chip8_t *machine) {
+static void opcode2(chip8_t *machine) {
     // Call subroutine at nnn
-    machine->SP++;
-    if (machine->SP > STACKSIZE) {
-        printf("Stack overflow\n");
-        exit(1);
+    if (machine->SP >= STACKSIZE) {
+        machine->error = CHIP8_ERR_STACK_OVERFLOW;
+        return;
     }
+    machine->SP++;
 
     machine->stack[machine->SP - 1] = machine->PC + 2;
     // opcode1(machine);
     machine->PC = machine->opcode & 0x0FFF;
 }
 
-void opcode3(chip8_t *machine) {
+static void opcode3(chip8_t *machine) {
     // skip next instruction if Vx = kk
     int x = (machine->opcode & 0x0F00) >> 8;
     int kk = (machine->opcode & 0x00FF);
@@ -50,7 +55,7 @@ void opcode3(chip8_t *machine) {
     machine->PC += (machine->V[x] == kk) ? 4 : 2;
 }
 
-void opcode4(chip8_t *machine) {
+static void opcode4(chip8_t *machine) {
     // skip next instruction if Vx = kk
     int x = (machine->opcode & 0x0F00) >> 8;
     int kk = (machine->opcode & 0x00FF);
@@ -58,7 +63,7 @@ void opcode4(chip8_t *machine) {
     machine->PC += (machine->V[x] != kk) ? 4 : 2;
 }
 
-void opcode5(chip8_t *machine) {
+static void opcode5(chip8_t *machine) {
     switch (machine->opcode & 0x000F) {
     case 0:
         // skip next instruction if Vx = Vy
@@ -69,12 +74,12 @@ void opcode5(chip8_t *machine) {
         } while (0);
         break;
     default:
-        printf("Unknown opcode 5x %4x\n", machine->opcode);
+        machine->error = CHIP8_ERR_UNKNOWN_OPCODE;
         break;
     }
 }
 
-void opcode6(chip8_t *machine) {
+static void opcode6(chip8_t *machine) {
     // Sets Vx = kk
     int x = (machine->opcode & 0x0F00) >> 8;
     int kk = (machine->opcode & 0x00FF);
@@ -83,7 +88,7 @@ void opcode6(chip8_t *machine) {
     machine->PC += 2;
 }
 
-void opcode7(chip8_t *machine) {
+static void opcode7(chip8_t *machine) {
     // Sets Vx = Vx + kk
     int x = (machine->opcode & 0x0F00) >> 8;
     int kk = (machine->opcode & 0x00FF);
@@ -92,7 +97,7 @@ void opcode7(chip8_t *machine) {
     machine->PC += 2;
 }
 
-void opcode8(chip8_t *machine) {
+static void opcode8(chip8_t *machine) {
     // multiplexed
     switch (machine->opcode & 0x000F) {
     case 0x0000:
@@ -165,14 +170,14 @@ void opcode8(chip8_t *machine) {
         } while (0);
         break;
     default:
-        printf("Unknown opcode 8x %4x\n", machine->opcode);
+        machine->error = CHIP8_ERR_UNKNOWN_OPCODE;
         break;
     }
 
     machine->PC += 2;
 }
 
-void opcode9(chip8_t *machine) {
+static void opcode9(chip8_t *machine) {
     switch (machine->opcode & 0x000F) {
         // skip next instruction if Vx != Vy
         int x = (machine->opcode & 0x0F00) >> 8;
@@ -181,56 +186,63 @@ void opcode9(chip8_t *machine) {
         machine->PC += (machine->V[x] != machine->V[y]) ? 4 : 2;
         return;
     default:
-        printf("Unknown opcode 9x %4x\n", machine->opcode);
+        machine->error = CHIP8_ERR_UNKNOWN_OPCODE;
         break;
     }
     machine->PC += 2;
 }
 
-void opcodeA(chip8_t *machine) {
+static void opcodeA(chip8_t *machine) {
     // Set I to nnn
     machine->I = machine->opcode & 0x0FFF;
     machine->PC += 2;
 }
 
-void opcodeB(chip8_t *machine) {
+static void opcodeB(chip8_t *machine) {
     // Jump to location nnn + V0
     machine->PC = (machine->opcode & 0x0FFF) + machine->V[0];
 }
 
-/* Returns an integer in the range [0, n).
+/* Returns the next number from an xorshift generator.
  *
- * Uses rand(), and so is affected-by/affects the same seed.
+ * The state lives in the machine (or a batch lane), so copies of it
+ * (run-ahead, save states) replay the same sequence and no global state
+ * is shared.
  */
-int randint(int n) {
-    if ((n - 1) == RAND_MAX) {
-        return rand();
-    } else {
-        // Chop off all of the values that would cause skew...
-        long end = RAND_MAX / n; // truncate skew
-        assert (end > 0L);
-        end *= n;
-
-        // ... and ignore results from rand() that fall above that limit.
-        // (Worst case the loop condition should succeed 50% of the time,
-        // so we can expect to bail out of this loop pretty quickly.)
-        int r;
-        while ((r = rand()) >= end);
-
-        return r % n;
-    }
+static unsigned int nextRandom(unsigned int *state) {
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+/* Returns an integer in the range [0, n). */
+int opcodes_randint(unsigned int *state, int n) {
+    // Chop off all of the values that would cause skew...
+    unsigned int end = 0xFFFFFFFFu / n; // truncate skew
+    assert (end > 0);
+    end *= n;
+
+    // ... and ignore results that fall above that limit.
+    // (Worst case the loop condition should succeed 50% of the time,
+    // so we can expect to bail out of this loop pretty quickly.)
+    unsigned int r;
+    while ((r = nextRandom(state)) >= end);
+
+    return r % n;
 }
 
-void opcodeC(chip8_t *machine) {
+static void opcodeC(chip8_t *machine) {
     // Set Vx = random byte AND kk
     int x = (machine->opcode & 0x0F00) >> 8;
     int kk = (machine->opcode & 0x00FF);
 
-    machine->V[x] = (unsigned short) (randint(256) & kk);
+    machine->V[x] = (unsigned short) (opcodes_randint(&machine->rng, 256) & kk);
     machine->PC += 2;
 }
 
-void opcodeD(chip8_t *machine) {
+static void opcodeD(chip8_t *machine) {
     // Display n-byte sprite starting at memory location I at (Vx, Vy), set VF = collision
     int x = (machine->opcode & 0x0F00) >> 8;
     int y = (machine->opcode & 0x00F0) >> 4;
@@ -256,10 +268,11 @@ void opcodeD(chip8_t *machine) {
     machine->PC += 2;
 }
 
-void opcodeE(chip8_t *machine) {
+static void opcodeE(chip8_t *machine) {
     // multiplexed
     int x = (machine->opcode & 0x0F00) >> 8;
-    int k = machine->V[x];
+    // only the low nibble names a key
+    int k = machine->V[x] & 0x0F;
 
     switch (machine->opcode & 0x00FF) {
     case 0x009E:
@@ -271,13 +284,13 @@ void opcodeE(chip8_t *machine) {
             machine->PC += 2;
         break;
     default:
-        printf("Unknown opcode Ex %4x\n", machine->opcode);
+        machine->error = CHIP8_ERR_UNKNOWN_OPCODE;
         break;
     }
     machine->PC += 2;
 }
 
-void opcodeF(chip8_t *machine) {
+static void opcodeF(chip8_t *machine) {
     // multiplexed
     int x = (machine->opcode & 0x0F00) >> 8;
     int pressed = -1;
@@ -328,13 +341,13 @@ void opcodeF(chip8_t *machine) {
             machine->V[i] = machine->RAM[machine->I + i];
         break;
     default:
-        printf("Unknown opcode Ex %4x\n", machine->opcode);
+        machine->error = CHIP8_ERR_UNKNOWN_OPCODE;
         break;
     }
     machine->PC += 2;
 }
 
-void (*opcodes[16])(chip8_t *machine) = {
+void (* const opcodes[16])(chip8_t *machine) = {
     opcode0, opcode1, opcode2, opcode3,
     opcode4, opcode5, opcode6, opcode7,
     opcode8, opcode9, opcodeA, opcodeB,
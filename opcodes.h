@@ -1,6 +1,11 @@
 #ifndef CHIP8_OPCODES_H_
 #define CHIP8_OPCODES_H_
 
-extern void (*opcodes[16])(chip8_t *machine);
+// Shared between the core's translation units only, not part of the
+// library's API
+extern void (* const opcodes[16])(chip8_t *machine) __attribute__((visibility("hidden")));
+
+// The Cxkk generator, which the batch interpreter runs per lane
+extern int opcodes_randint(unsigned int *state, int n) __attribute__((visibility("hidden")));
 
 #endif
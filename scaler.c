@@ -0,0 +1,295 @@
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "chip8.h"
+#include "scaler.h"
+
+// The edge filters work on an intensity image (0 = off, 255 = on) so that
+// xBR can emit half-tones; the palette maps every intensity to a colour.
+static uint32_t palette[256];
+static int paletteReady = 0;
+
+// Intermediate image produced by the filters, at most SCALER_MAX_BASE
+// times the CHIP-8 resolution in each direction
+static unsigned char filtered[VRAMSIZE * SCALER_MAX_BASE * SCALER_MAX_BASE];
+
+static const char *names[SCALER_MODES] = {
+    "nearest", "scale2x", "scale3x", "xbr"
+};
+
+const char *scaler_name(scaler_mode mode) {
+    return (mode >= 0 && mode < SCALER_MODES) ? names[mode] : "unknown";
+}
+
+int scaler_fromName(const char *name) {
+    for (int i = 0; i < SCALER_MODES; ++i)
+        if (strcmp(name, names[i]) == 0)
+            return i;
+    return -1;
+}
+
+int scaler_baseFactor(scaler_mode mode) {
+    switch (mode) {
+    case SCALER_SCALE2X:
+    case SCALER_XBR:
+        return 2;
+    case SCALER_SCALE3X:
+        return 3;
+    default:
+        return 1;
+    }
+}
+
+// Largest output factor not above maxFactor that the filter can reach
+// with an integer nearest-neighbour expansion of its own output
+int scaler_fitFactor(scaler_mode mode, int maxFactor) {
+    int base = scaler_baseFactor(mode);
+    int factor = (maxFactor / base) * base;
+    return factor < base ? base : factor;
+}
+
+void scaler_setPalette(uint32_t off, uint32_t on) {
+    for (int i = 0; i < 256; ++i) {
+        uint32_t c = 0;
+        for (int shift = 0; shift < 32; shift += 8) {
+            int a = (off >> shift) & 0xFF;
+            int b = (on >> shift) & 0xFF;
+            c |= (uint32_t) ((a * (255 - i) + b * i + 127) / 255) << shift;
+        }
+        palette[i] = c;
+    }
+    paletteReady = 1;
+}
+
+/*************************************************
+ ** EDGE FILTERS
+ ************************************************/
+#define PX(x, y) src[clampi((y), 0, h - 1) * w + clampi((x), 0, w - 1)]
+
+static inline int clampi(int v, int lo, int hi) {
+    return v < lo ? lo : (v > hi ? hi : v);
+}
+
+static void toIntensity(const unsigned char *vram, int w, int h, unsigned char *out) {
+    for (int i = 0; i < w * h; ++i)
+        out[i] = vram[i] ? 255 : 0;
+}
+
+static void scale2x(const unsigned char *src, int w, int h, unsigned char *dst) {
+    int dw = w * 2;
+
+    for (int y = 0; y < h; ++y) {
+        for (int x = 0; x < w; ++x) {
+            unsigned char B = PX(x, y - 1), D = PX(x - 1, y), E = PX(x, y);
+            unsigned char F = PX(x + 1, y), H = PX(x, y + 1);
+            unsigned char *o = dst + (y * 2) * dw + x * 2;
+
+            if (B != H && D != F) {
+                o[0]      = D == B ? D : E;
+                o[1]      = B == F ? F : E;
+                o[dw]     = D == H ? D : E;
+                o[dw + 1] = H == F ? F : E;
+            }
+            else {
+                o[0] = o[1] = o[dw] = o[dw + 1] = E;
+            }
+        }
+    }
+}
+
+static void scale3x(const unsigned char *src, int w, int h, unsigned char *dst) {
+    int dw = w * 3;
+
+    for (int y = 0; y < h; ++y) {
+        for (int x = 0; x < w; ++x) {
+            unsigned char A = PX(x - 1, y - 1), B = PX(x, y - 1), C = PX(x + 1, y - 1);
+            unsigned char D = PX(x - 1, y),     E = PX(x, y),     F = PX(x + 1, y);
+            unsigned char G = PX(x - 1, y + 1), H = PX(x, y + 1), I = PX(x + 1, y + 1);
+            unsigned char *o = dst + (y * 3) * dw + x * 3;
+
+            for (int i = 0; i < 3; ++i)
+                o[i] = o[dw + i] = o[2 * dw + i] = E;
+
+            if (B != H && D != F) {
+                o[0]          = D == B ? D : E;
+                o[1]          = ((D == B && E != C) || (B == F && E != A)) ? B : E;
+                o[2]          = B == F ? F : E;
+                o[dw]         = ((D == B && E != G) || (D == H && E != A)) ? D : E;
+                o[dw + 2]     = ((B == F && E != I) || (H == F && E != C)) ? F : E;
+                o[2 * dw]     = D == H ? D : E;
+                o[2 * dw + 1] = ((D == H && E != I) || (H == F && E != G)) ? H : E;
+                o[2 * dw + 2] = H == F ? F : E;
+            }
+        }
+    }
+}
+
+static inline int dist(int a, int b) {
+    return a > b ? a - b : b - a;
+}
+
+// One corner of the 2xBR rule. (ux, uy) points from E towards F and
+// (vx, vy) from E towards H; the four corners are the four sign choices.
+static unsigned char xbrCorner(const unsigned char *src, int w, int h,
+                               int x, int y, int ux, int uy, int vx, int vy) {
+#define R(a, b) PX(x + (a) * ux + (b) * vx, y + (a) * uy + (b) * vy)
+    int E = R(0, 0);
+    int F = R(1, 0), H = R(0, 1), I = R(1, 1);
+    int B = R(0, -1), D = R(-1, 0), C = R(1, -1), G = R(-1, 1);
+    int F4 = R(2, 0), H5 = R(0, 2), I4 = R(2, 1), I5 = R(1, 2);
+#undef R
+
+    if (E == F || E == H)
+        return E;
+
+    int across = dist(E, C) + dist(E, G) + dist(I, F4) + dist(I, H5) + 4 * dist(H, F);
+    int along  = dist(H, D) + dist(H, I5) + dist(F, I4) + dist(F, B) + 4 * dist(E, I);
+    if (across >= along)
+        return E;
+
+    int edge = dist(E, F) <= dist(E, H) ? F : H;
+    return (unsigned char) ((E + edge + 1) / 2);
+}
+
+static void xbr2x(const unsigned char *src, int w, int h, unsigned char *dst) {
+    int dw = w * 2;
+
+    for (int y = 0; y < h; ++y) {
+        for (int x = 0; x < w; ++x) {
+            unsigned char *o = dst + (y * 2) * dw + x * 2;
+            o[0]      = xbrCorner(src, w, h, x, y, -1, 0, 0, -1);
+            o[1]      = xbrCorner(src, w, h, x, y,  1, 0, 0, -1);
+            o[dw]     = xbrCorner(src, w, h, x, y, -1, 0, 0,  1);
+            o[dw + 1] = xbrCorner(src, w, h, x, y,  1, 0, 0,  1);
+        }
+    }
+}
+
+#undef PX
+
+/*************************************************
+ ** NEAREST NEIGHBOUR EXPANSION
+ **
+ ** This is where nearly all of the time goes at large output sizes, so the
+ ** row fill is vectorised. Each source row is expanded once and the
+ ** remaining factor - 1 output rows are copied from it.
+ ************************************************/
+static void expandRow_scalar(const unsigned char *src, int w, uint32_t *dst, int f) {
+    for (int x = 0; x < w; ++x) {
+        uint32_t c = palette[src[x]];
+        for (int i = 0; i < f; ++i)
+            *dst++ = c;
+    }
+}
+
+#if defined(__SSE2__)
+static void expandRow_sse2(const unsigned char *src, int w, uint32_t *dst, int f) {
+    if (f < 4) {
+        expandRow_scalar(src, w, dst, f);
+        return;
+    }
+
+    for (int x = 0; x < w; ++x) {
+        __m128i c = _mm_set1_epi32((int) palette[src[x]]);
+        int i = 0;
+        for (; i + 4 <= f; i += 4)
+            _mm_storeu_si128((__m128i *) (dst + i), c);
+        // an overlapping store finishes the run without a scalar tail
+        if (i < f)
+            _mm_storeu_si128((__m128i *) (dst + f - 4), c);
+        dst += f;
+    }
+}
+#endif
+
+#if defined(__SSE2__) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCALER_HAVE_AVX2 1
+
+__attribute__((target("avx2")))
+static void expandRow_avx2(const unsigned char *src, int w, uint32_t *dst, int f) {
+    if (f < 8) {
+        expandRow_sse2(src, w, dst, f);
+        return;
+    }
+
+    for (int x = 0; x < w; ++x) {
+        __m256i c = _mm256_set1_epi32((int) palette[src[x]]);
+        int i = 0;
+        for (; i + 8 <= f; i += 8)
+            _mm256_storeu_si256((__m256i *) (dst + i), c);
+        if (i < f)
+            _mm256_storeu_si256((__m256i *) (dst + f - 8), c);
+        dst += f;
+    }
+}
+#endif
+
+typedef void (*expandRow_fn)(const unsigned char *src, int w, uint32_t *dst, int f);
+
+static expandRow_fn pickExpandRow(void) {
+#if defined(SCALER_HAVE_AVX2)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return expandRow_avx2;
+#endif
+#if defined(__SSE2__)
+    return expandRow_sse2;
+#else
+    return expandRow_scalar;
+#endif
+}
+
+static void expand(const unsigned char *src, int w, int h, uint32_t *dst, int pitch, int f) {
+    static expandRow_fn expandRow = NULL;
+    if (!expandRow)
+        expandRow = pickExpandRow();
+
+    size_t rowBytes = (size_t) w * f * sizeof(uint32_t);
+
+    for (int y = 0; y < h; ++y) {
+        uint32_t *first = (uint32_t *) ((unsigned char *) dst + (size_t) y * f * pitch);
+        expandRow(src + y * w, w, first, f);
+        for (int i = 1; i < f; ++i)
+            memcpy((unsigned char *) first + (size_t) i * pitch, first, rowBytes);
+    }
+}
+
+// Scales a width x height VRAM buffer into dst (ARGB, pitch in bytes), which
+// must hold width * factor x height * factor pixels. factor must be a
+// multiple of the mode's base factor; returns 0 otherwise.
+int scaler_run(scaler_mode mode, const unsigned char *vram, int width, int height,
+               uint32_t *dst, int pitch, int factor) {
+    int base = scaler_baseFactor(mode);
+
+    if (factor < base || factor % base != 0)
+        return 0;
+    if (width * height > VRAMSIZE)
+        return 0;
+
+    if (!paletteReady)
+        scaler_setPalette(0xFF000000, 0xFFFFFFFF);
+
+    unsigned char intensity[VRAMSIZE];
+    toIntensity(vram, width, height, intensity);
+
+    switch (mode) {
+    case SCALER_SCALE2X:
+        scale2x(intensity, width, height, filtered);
+        break;
+    case SCALER_SCALE3X:
+        scale3x(intensity, width, height, filtered);
+        break;
+    case SCALER_XBR:
+        xbr2x(intensity, width, height, filtered);
+        break;
+    default:
+        memcpy(filtered, intensity, width * height);
+        break;
+    }
+
+    expand(filtered, width * base, height * base, dst, pitch, factor / base);
+    return 1;
+}
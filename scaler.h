@@ -0,0 +1,26 @@
+#ifndef CHIP8_SCALER_H_
+#define CHIP8_SCALER_H_
+
+#include <stdint.h>
+
+// The filters never produce more than this many pixels per source pixel
+// before the final nearest-neighbour expansion.
+#define SCALER_MAX_BASE 3
+
+typedef enum {
+    SCALER_NEAREST,
+    SCALER_SCALE2X,
+    SCALER_SCALE3X,
+    SCALER_XBR,
+    SCALER_MODES
+} scaler_mode;
+
+extern const char *scaler_name(scaler_mode mode);
+extern int scaler_fromName(const char *name);
+extern int scaler_baseFactor(scaler_mode mode);
+extern int scaler_fitFactor(scaler_mode mode, int maxFactor);
+extern void scaler_setPalette(uint32_t off, uint32_t on);
+extern int scaler_run(scaler_mode mode, const unsigned char *vram, int width, int height,
+                      uint32_t *dst, int pitch, int factor);
+
+#endif
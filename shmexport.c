@@ -0,0 +1,156 @@
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shmexport.h"
+
+// How often a reader retries before giving up on a writer that stays in
+// the middle of an update (e.g. because it died there)
+#define SHMEXPORT_RETRIES 1000
+
+static void seqBegin(atomic_uint *seq) {
+    unsigned s = atomic_load_explicit(seq, memory_order_relaxed);
+    atomic_store_explicit(seq, s + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void seqEnd(atomic_uint *seq) {
+    unsigned s = atomic_load_explicit(seq, memory_order_relaxed);
+    atomic_store_explicit(seq, s + 1, memory_order_release);
+}
+
+// Copies size bytes from src while *seq is stable and even
+static int seqRead(atomic_uint *seq, void *dst, const void *src, size_t size) {
+    for (int i = 0; i < SHMEXPORT_RETRIES; ++i) {
+        unsigned before = atomic_load_explicit(seq, memory_order_acquire);
+        if (before & 1)
+            continue;
+
+        memcpy(dst, src, size);
+
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(seq, memory_order_relaxed) == before)
+            return 1;
+    }
+
+    return 0;
+}
+
+static shmexport_t *map(int fd) {
+    void *p = mmap(NULL, sizeof(shmexport_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int error = errno;
+    close(fd);
+    errno = error;
+    return p == MAP_FAILED ? NULL : p;
+}
+
+// Removes a half made segment without losing the errno that explains why
+static void unlinkFailed(const char *name) {
+    int error = errno;
+    shm_unlink(name);
+    errno = error;
+}
+
+// Creates (or replaces) the segment called name, e.g. "/chip8"; the
+// emulator then runs &shm->machine directly. Returns NULL with errno set
+// on failure.
+shmexport_t *shmexport_create(const char *name) {
+    int fd = shm_open(name, O_CREAT | O_RDWR, 0600);
+    if (fd < 0)
+        return NULL;
+
+    if (ftruncate(fd, sizeof(shmexport_t)) < 0) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        unlinkFailed(name);
+        return NULL;
+    }
+
+    shmexport_t *shm = map(fd);
+    if (!shm) {
+        unlinkFailed(name);
+        return NULL;
+    }
+
+    memset(shm, 0, sizeof(shmexport_t));
+    shm->magic = SHMEXPORT_MAGIC;
+    shm->version = SHMEXPORT_VERSION;
+    shm->machineSize = sizeof(chip8_t);
+    atomic_init(&shm->seq, 0);
+    atomic_init(&shm->keySeq, 0);
+
+    return shm;
+}
+
+void shmexport_destroy(shmexport_t *shm, const char *name) {
+    munmap(shm, sizeof(shmexport_t));
+    shm_unlink(name);
+}
+
+// Brackets every change the emulator makes to shm->machine
+void shmexport_beginWrite(shmexport_t *shm) {
+    seqBegin(&shm->seq);
+}
+
+void shmexport_endWrite(shmexport_t *shm) {
+    seqEnd(&shm->seq);
+}
+
+// Fetches the injected keys; returns 0 and leaves keys alone if the
+// external writer is mid-update
+int shmexport_readKeys(shmexport_t *shm, unsigned char keys[16]) {
+    unsigned char copy[16];
+
+    if (!seqRead(&shm->keySeq, copy, shm->keys, sizeof(copy)))
+        return 0;
+
+    memcpy(keys, copy, sizeof(copy));
+    return 1;
+}
+
+// Returns NULL with errno set on failure; EPROTO means the segment was
+// made by an incompatible version of the emulator
+shmexport_t *shmexport_open(const char *name) {
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+        return NULL;
+
+    shmexport_t *shm = map(fd);
+    if (!shm)
+        return NULL;
+
+    if (shm->magic != SHMEXPORT_MAGIC || shm->version != SHMEXPORT_VERSION
+        || shm->machineSize != sizeof(chip8_t)) {
+        munmap(shm, sizeof(shmexport_t));
+        errno = EPROTO;
+        return NULL;
+    }
+
+    return shm;
+}
+
+void shmexport_close(shmexport_t *shm) {
+    munmap(shm, sizeof(shmexport_t));
+}
+
+// Copies a consistent state of the machine, as of the end of a cycle. The
+// emulator's host pointer is meaningless here, so the copy has none.
+int shmexport_snapshot(shmexport_t *shm, chip8_t *machine) {
+    if (!seqRead(&shm->seq, machine, &shm->machine, sizeof(chip8_t)))
+        return 0;
+
+    machine->host = NULL;
+    return 1;
+}
+
+// Sets the keys an external process holds down. Only one process should
+// inject at a time.
+void shmexport_injectKeys(shmexport_t *shm, const unsigned char keys[16]) {
+    seqBegin(&shm->keySeq);
+    memcpy(shm->keys, keys, sizeof(shm->keys));
+    seqEnd(&shm->keySeq);
+}
@@ -0,0 +1,44 @@
+#ifndef CHIP8_SHMEXPORT_H_
+#define CHIP8_SHMEXPORT_H_
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "chip8.h"
+
+#define SHMEXPORT_MAGIC 0x38504843 /* "CHP8" */
+#define SHMEXPORT_VERSION 2
+
+// Layout of the POSIX shared memory segment. The emulator runs the machine
+// in place, so exporting costs two counter updates per cycle and nothing
+// is copied on its side.
+//
+// Both directions are seqlocks: a counter that is odd while its writer is
+// inside an update. Readers sample it, copy, and retry if it was odd or
+// changed in the meantime.
+typedef struct shmexport {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t machineSize;   // sizeof(chip8_t), to catch layout mismatches
+
+    atomic_uint seq;        // guards machine, written by the emulator
+    atomic_uint keySeq;     // guards keys, written by an external process
+    unsigned char keys[16]; // pressed keys to merge with the local keyboard
+
+    chip8_t machine;
+} shmexport_t;
+
+// emulator side
+extern shmexport_t *shmexport_create(const char *name);
+extern void shmexport_destroy(shmexport_t *shm, const char *name);
+extern void shmexport_beginWrite(shmexport_t *shm);
+extern void shmexport_endWrite(shmexport_t *shm);
+extern int shmexport_readKeys(shmexport_t *shm, unsigned char keys[16]);
+
+// consumer side
+extern shmexport_t *shmexport_open(const char *name);
+extern void shmexport_close(shmexport_t *shm);
+extern int shmexport_snapshot(shmexport_t *shm, chip8_t *machine);
+extern void shmexport_injectKeys(shmexport_t *shm, const unsigned char keys[16]);
+
+#endif
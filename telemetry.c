@@ -0,0 +1,188 @@
+#include <string.h>
+
+#include "telemetry.h"
+
+// A sleep that overshoots by more than this counts as an oversleep
+#define OVERSLEEP_SLACK_US 1000
+
+// Rates are recomputed (and stats written) this often by default
+#define DEFAULT_PERIOD_US 1000000
+
+static const char *phaseNames[TELEMETRY_PHASES] = {
+    "emulate", "render", "present", "sleep", "frame"
+};
+
+static int bucketIndex(uint64_t value) {
+    if (value < TELEMETRY_SUB_BUCKETS)
+        return (int) value;
+
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - 4;
+    int index = TELEMETRY_SUB_BUCKETS + shift * TELEMETRY_SUB_BUCKETS
+        + (int) ((value >> shift) - TELEMETRY_SUB_BUCKETS);
+
+    return index < TELEMETRY_BUCKETS ? index : TELEMETRY_BUCKETS - 1;
+}
+
+// Middle of the range of values that land in bucket index
+static uint64_t bucketValue(int index) {
+    if (index < TELEMETRY_SUB_BUCKETS)
+        return index;
+
+    int shift = (index - TELEMETRY_SUB_BUCKETS) / TELEMETRY_SUB_BUCKETS;
+    uint64_t mantissa = TELEMETRY_SUB_BUCKETS + (index - TELEMETRY_SUB_BUCKETS) % TELEMETRY_SUB_BUCKETS;
+
+    return (mantissa << shift) + ((1ull << shift) >> 1);
+}
+
+static void histogramRecord(telemetry_histogram_t *h, uint64_t value) {
+    ++h->counts[bucketIndex(value)];
+    ++h->total;
+    if (value > h->max)
+        h->max = value;
+}
+
+uint64_t telemetry_percentile(const telemetry_histogram_t *h, double percentile) {
+    if (!h->total)
+        return 0;
+
+    uint64_t wanted = (uint64_t) (percentile / 100.0 * h->total + 0.5);
+    if (wanted < 1)
+        wanted = 1;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < TELEMETRY_BUCKETS; ++i) {
+        seen += h->counts[i];
+        if (seen >= wanted) {
+            uint64_t value = bucketValue(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+
+    return h->max;
+}
+
+const char *telemetry_phaseName(telemetry_phase phase) {
+    return phaseNames[phase];
+}
+
+void telemetry_init(telemetry_t *t, uint64_t budgetUs, uint64_t nowUs) {
+    memset(t, 0, sizeof(telemetry_t));
+    t->budgetUs = budgetUs;
+    t->startUs = nowUs;
+    t->periodStartUs = nowUs;
+    t->periodUs = DEFAULT_PERIOD_US;
+}
+
+// Stats go out as JSON lines if filename ends in .json, CSV otherwise
+int telemetry_openStats(telemetry_t *t, const char *filename, uint64_t periodUs) {
+    size_t len = strlen(filename);
+
+    t->stats = fopen(filename, "w");
+    if (!t->stats) {
+        printf("Could not open stats file %s\n", filename);
+        return 0;
+    }
+
+    t->json = len > 5 && strcmp(filename + len - 5, ".json") == 0;
+    if (periodUs)
+        t->periodUs = periodUs;
+
+    if (!t->json) {
+        fprintf(t->stats, "time_s,ips,fps,frames,oversleeps,missed_deadlines");
+        for (int p = 0; p < TELEMETRY_PHASES; ++p)
+            fprintf(t->stats, ",%s_p50_us,%s_p90_us,%s_p99_us,%s_max_us",
+                    phaseNames[p], phaseNames[p], phaseNames[p], phaseNames[p]);
+        fprintf(t->stats, "\n");
+    }
+
+    return 1;
+}
+
+static void writeStats(telemetry_t *t, uint64_t nowUs) {
+    double seconds = (nowUs - t->startUs) / 1e6;
+
+    if (t->json) {
+        fprintf(t->stats, "{\"time_s\":%.3f,\"ips\":%.0f,\"fps\":%.1f,\"frames\":%llu,"
+                "\"oversleeps\":%llu,\"missed_deadlines\":%llu",
+                seconds, t->ips, t->fps, (unsigned long long) t->frames,
+                (unsigned long long) t->oversleeps, (unsigned long long) t->missedDeadlines);
+        for (int p = 0; p < TELEMETRY_PHASES; ++p) {
+            const telemetry_histogram_t *h = &t->phases[p];
+            fprintf(t->stats, ",\"%s_us\":{\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"max\":%llu}",
+                    phaseNames[p],
+                    (unsigned long long) telemetry_percentile(h, 50),
+                    (unsigned long long) telemetry_percentile(h, 90),
+                    (unsigned long long) telemetry_percentile(h, 99),
+                    (unsigned long long) h->max);
+        }
+        fprintf(t->stats, "}\n");
+    }
+    else {
+        fprintf(t->stats, "%.3f,%.0f,%.1f,%llu,%llu,%llu",
+                seconds, t->ips, t->fps, (unsigned long long) t->frames,
+                (unsigned long long) t->oversleeps, (unsigned long long) t->missedDeadlines);
+        for (int p = 0; p < TELEMETRY_PHASES; ++p) {
+            const telemetry_histogram_t *h = &t->phases[p];
+            fprintf(t->stats, ",%llu,%llu,%llu,%llu",
+                    (unsigned long long) telemetry_percentile(h, 50),
+                    (unsigned long long) telemetry_percentile(h, 90),
+                    (unsigned long long) telemetry_percentile(h, 99),
+                    (unsigned long long) h->max);
+        }
+        fprintf(t->stats, "\n");
+    }
+
+    fflush(t->stats);
+}
+
+void telemetry_close(telemetry_t *t, uint64_t nowUs) {
+    if (t->stats) {
+        writeStats(t, nowUs);
+        fclose(t->stats);
+        t->stats = NULL;
+    }
+}
+
+void telemetry_record(telemetry_t *t, telemetry_phase phase, uint64_t us) {
+    histogramRecord(&t->phases[phase], us);
+}
+
+void telemetry_sleep(telemetry_t *t, uint64_t requestedUs, uint64_t actualUs) {
+    histogramRecord(&t->phases[TELEMETRY_SLEEP], actualUs);
+    if (actualUs > requestedUs + OVERSLEEP_SLACK_US)
+        ++t->oversleeps;
+}
+
+// Closes a main loop iteration; workUs is the part before the throttle
+// sleep, which has to fit in the budget. Once per period this updates the
+// rates, writes a stats line and starts the histograms over.
+void telemetry_endFrame(telemetry_t *t, uint64_t workUs, uint64_t frameUs,
+                        int instructions, int presented, uint64_t nowUs) {
+    histogramRecord(&t->phases[TELEMETRY_FRAME], frameUs);
+
+    ++t->frames;
+    t->instructions += instructions;
+    t->periodInstructions += instructions;
+    t->presented += presented;
+    t->periodPresented += presented;
+    if (workUs > t->budgetUs)
+        ++t->missedDeadlines;
+
+    t->recent[t->recentPos] = workUs > UINT32_MAX ? UINT32_MAX : (uint32_t) workUs;
+    t->recentPos = (t->recentPos + 1) % TELEMETRY_RECENT;
+
+    uint64_t elapsed = nowUs - t->periodStartUs;
+    if (elapsed >= t->periodUs) {
+        t->ips = t->periodInstructions * 1e6 / elapsed;
+        t->fps = t->periodPresented * 1e6 / elapsed;
+
+        if (t->stats)
+            writeStats(t, nowUs);
+
+        memset(t->phases, 0, sizeof(t->phases));
+        t->periodStartUs = nowUs;
+        t->periodInstructions = 0;
+        t->periodPresented = 0;
+    }
+}
@@ -0,0 +1,75 @@
+#ifndef CHIP8_TELEMETRY_H_
+#define CHIP8_TELEMETRY_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Log-linear buckets in the style of HdrHistogram: values below 16 get a
+// bucket each, above that every power of two is split into 16 buckets, so
+// any value is known to within about 6%. Values are in microseconds and
+// clamp at 2^40.
+#define TELEMETRY_SUB_BUCKETS 16
+#define TELEMETRY_BUCKETS (TELEMETRY_SUB_BUCKETS + 37 * TELEMETRY_SUB_BUCKETS)
+
+// Work times (each frame before its throttle sleep) kept for the overlay
+// graph, the same thing missedDeadlines is counted from
+#define TELEMETRY_RECENT 128
+
+typedef enum {
+    TELEMETRY_EMULATE,
+    TELEMETRY_RENDER,
+    TELEMETRY_PRESENT,
+    TELEMETRY_SLEEP,
+    TELEMETRY_FRAME,
+    TELEMETRY_PHASES
+} telemetry_phase;
+
+typedef struct telemetry_histogram {
+    uint64_t counts[TELEMETRY_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} telemetry_histogram_t;
+
+typedef struct telemetry {
+    uint64_t budgetUs;
+
+    // histograms cover the current reporting period
+    telemetry_histogram_t phases[TELEMETRY_PHASES];
+
+    // running totals
+    uint64_t frames;
+    uint64_t presented;
+    uint64_t instructions;
+    uint64_t oversleeps;
+    uint64_t missedDeadlines;
+
+    // rates over the last period
+    double ips;
+    double fps;
+
+    uint64_t periodStartUs;
+    uint64_t periodInstructions;
+    uint64_t periodPresented;
+
+    uint32_t recent[TELEMETRY_RECENT];
+    int recentPos;
+
+    FILE *stats;
+    int json;
+    uint64_t startUs;
+    uint64_t periodUs;
+} telemetry_t;
+
+extern void telemetry_init(telemetry_t *t, uint64_t budgetUs, uint64_t nowUs);
+extern int telemetry_openStats(telemetry_t *t, const char *filename, uint64_t periodUs);
+extern void telemetry_close(telemetry_t *t, uint64_t nowUs);
+
+extern void telemetry_record(telemetry_t *t, telemetry_phase phase, uint64_t us);
+extern void telemetry_sleep(telemetry_t *t, uint64_t requestedUs, uint64_t actualUs);
+extern void telemetry_endFrame(telemetry_t *t, uint64_t workUs, uint64_t frameUs,
+                               int instructions, int presented, uint64_t nowUs);
+
+extern uint64_t telemetry_percentile(const telemetry_histogram_t *h, double percentile);
+extern const char *telemetry_phaseName(telemetry_phase phase);
+
+#endif
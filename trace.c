@@ -0,0 +1,452 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "trace.h"
+
+#define KIND_MASK             0x07
+#define FLAG_SAME_INSTRUCTION 0x08
+#define FLAG_NEXT_CYCLE       0x10
+#define FLAG_NEXT_PC          0x20
+#define FLAG_SAME_OPCODE      0x40
+
+// Largest encoded record is flags, a 5 byte varint, PC, opcode and a
+// stack write; plus the record count in front
+#define TRACE_BLOCK_BYTES (TRACE_BUFFER_RECORDS * 15 + 5)
+
+// The emulator fills buffers[active] and swaps when it is full; the writer
+// thread owns the other buffer from the post on full until it posts spare.
+// Both sides only ever wait when the writer falls a whole buffer behind.
+struct trace {
+    FILE *fp;
+
+    trace_record_t *buffers[2];
+    int active;
+    int count;
+    uint64_t cycle;
+
+    trace_record_t *pending;
+    int pendingCount;
+    sem_t full;
+    sem_t spare;
+    pthread_t thread;
+    unsigned long stalls;
+
+    // writer thread state
+    uint32_t lastCycle;
+    uint16_t lastPC;
+    uint16_t lastOpcode[RAMSIZE];
+    unsigned char *block;
+    unsigned long records;
+    unsigned long long bytes;
+};
+
+static unsigned char *putVarint(unsigned char *out, uint32_t value) {
+    while (value >= 0x80) {
+        *out++ = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    *out++ = value;
+    return out;
+}
+
+static unsigned char *putU16(unsigned char *out, int value) {
+    *out++ = value & 0xFF;
+    *out++ = (value >> 8) & 0xFF;
+    return out;
+}
+
+static int readVarint(FILE *fp, uint32_t *value) {
+    uint32_t result = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        int c = fgetc(fp);
+        if (c == EOF)
+            return 0;
+        result |= (uint32_t) (c & 0x7F) << shift;
+        if (!(c & 0x80)) {
+            *value = result;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int readU16(FILE *fp) {
+    int lo = fgetc(fp);
+    int hi = fgetc(fp);
+    return (lo == EOF || hi == EOF) ? -1 : lo | (hi << 8);
+}
+
+// Compresses a buffer of records into trace->block and writes it out
+static void encodeBlock(trace_t *trace, const trace_record_t *records, int count) {
+    unsigned char *out = putVarint(trace->block, count);
+
+    for (int i = 0; i < count; ++i) {
+        const trace_record_t *r = &records[i];
+        uint32_t delta = r->cycle - trace->lastCycle;
+        int slot = r->pc & (RAMSIZE - 1);
+        int flags = r->kind;
+
+        // the cycle counter never stands still, so a delta of 0 can only
+        // be another change made by the same instruction
+        if (delta == 0 && trace->records) {
+            flags |= FLAG_SAME_INSTRUCTION;
+        }
+        else {
+            if (delta == 1)
+                flags |= FLAG_NEXT_CYCLE;
+            if (r->pc == (uint16_t) (trace->lastPC + 2))
+                flags |= FLAG_NEXT_PC;
+            if (r->opcode == trace->lastOpcode[slot])
+                flags |= FLAG_SAME_OPCODE;
+        }
+
+        *out++ = flags;
+
+        if (!(flags & FLAG_SAME_INSTRUCTION)) {
+            if (!(flags & FLAG_NEXT_CYCLE))
+                out = putVarint(out, delta);
+            if (!(flags & FLAG_NEXT_PC))
+                out = putU16(out, r->pc);
+            if (!(flags & FLAG_SAME_OPCODE))
+                out = putU16(out, r->opcode);
+        }
+
+        switch (r->kind) {
+        case TRACE_REGISTER:
+            *out++ = r->target;
+            *out++ = r->oldValue;
+            *out++ = r->newValue;
+            break;
+        case TRACE_INDEX:
+            out = putU16(out, r->oldValue);
+            out = putU16(out, r->newValue);
+            break;
+        case TRACE_MEMORY:
+            out = putU16(out, r->target);
+            *out++ = r->oldValue;
+            *out++ = r->newValue;
+            break;
+        case TRACE_STACK:
+            *out++ = r->target;
+            out = putU16(out, r->oldValue);
+            out = putU16(out, r->newValue);
+            break;
+        }
+
+        trace->lastCycle = r->cycle;
+        trace->lastPC = r->pc;
+        trace->lastOpcode[slot] = r->opcode;
+        ++trace->records;
+    }
+
+    fwrite(trace->block, 1, out - trace->block, trace->fp);
+    trace->bytes += out - trace->block;
+}
+
+static void *writerThread(void *arg) {
+    trace_t *trace = arg;
+
+    for (;;) {
+        sem_wait(&trace->full);
+
+        // a post with nothing pending is trace_close telling us to stop
+        if (!trace->pending)
+            break;
+
+        encodeBlock(trace, trace->pending, trace->pendingCount);
+        trace->pending = NULL;
+        sem_post(&trace->spare);
+    }
+
+    return NULL;
+}
+
+// Hands the active buffer to the writer and switches to the other one
+static void flush(trace_t *trace) {
+    if (sem_trywait(&trace->spare) != 0) {
+        ++trace->stalls;
+        sem_wait(&trace->spare);
+    }
+
+    trace->pending = trace->buffers[trace->active];
+    trace->pendingCount = trace->count;
+    sem_post(&trace->full);
+
+    trace->active = !trace->active;
+    trace->count = 0;
+}
+
+static inline void append(trace_t *trace, const trace_record_t *base, int kind,
+                          int target, int oldValue, int newValue) {
+    trace_record_t *r = &trace->buffers[trace->active][trace->count];
+
+    *r = *base;
+    r->kind = kind;
+    r->target = target;
+    r->oldValue = oldValue;
+    r->newValue = newValue;
+
+    if (++trace->count == TRACE_BUFFER_RECORDS)
+        flush(trace);
+}
+
+trace_t *trace_open(const char *filename) {
+    trace_t *trace = calloc(1, sizeof(trace_t));
+    if (!trace)
+        return NULL;
+
+    trace->buffers[0] = malloc(TRACE_BUFFER_RECORDS * sizeof(trace_record_t));
+    trace->buffers[1] = malloc(TRACE_BUFFER_RECORDS * sizeof(trace_record_t));
+    trace->block = malloc(TRACE_BLOCK_BYTES);
+    trace->fp = fopen(filename, "wb");
+
+    if (!trace->buffers[0] || !trace->buffers[1] || !trace->block || !trace->fp) {
+        printf("Could not open trace file %s\n", filename);
+        goto fail;
+    }
+
+    fwrite(TRACE_MAGIC, 1, TRACE_MAGIC_LEN, trace->fp);
+
+    sem_init(&trace->full, 0, 0);
+    sem_init(&trace->spare, 0, 1);
+
+    if (pthread_create(&trace->thread, NULL, writerThread, trace) != 0) {
+        printf("Could not start the trace thread\n");
+        sem_destroy(&trace->full);
+        sem_destroy(&trace->spare);
+        goto fail;
+    }
+
+    return trace;
+
+fail:
+    if (trace->fp)
+        fclose(trace->fp);
+    free(trace->buffers[0]);
+    free(trace->buffers[1]);
+    free(trace->block);
+    free(trace);
+    return NULL;
+}
+
+// Runs chip8_cycle on machine and records what the instruction changed;
+// returns what chip8_cycle did. Registers, I and SP are diffed; memory
+// writes (Fx33, Fx55), timer writes (Fx15, Fx18) and the return address
+// a call pushes are worked out from the opcode so that writes of an
+// unchanged value still show up.
+int trace_step(trace_t *trace, chip8_t *machine) {
+    unsigned char V[NUM_REGISTERS];
+    unsigned char saved[NUM_REGISTERS];
+    unsigned short pc = machine->PC;
+    unsigned short I = machine->I;
+    unsigned short SP = machine->SP;
+    unsigned short slot = SP < STACKSIZE ? machine->stack[SP] : 0;
+    unsigned char DT = machine->delay_timer;
+    unsigned char ST = machine->sound_timer;
+    unsigned short opcode = (machine->RAM[pc] << 8) | machine->RAM[pc + 1];
+    int stores = 0;
+
+    if ((opcode & 0xF0FF) == 0xF033)
+        stores = 3;
+    else if ((opcode & 0xF0FF) == 0xF055)
+        stores = ((opcode & 0x0F00) >> 8) + 1;
+
+    // writes past the end of RAM aren't followed
+    if (I + stores > RAMSIZE)
+        stores = I < RAMSIZE ? RAMSIZE - I : 0;
+
+    memcpy(V, machine->V, sizeof(V));
+    memcpy(saved, machine->RAM + I, stores);
+
+    int running = chip8_cycle(machine);
+
+    trace_record_t base = { (uint32_t) trace->cycle++, pc, opcode, 0, 0, 0, TRACE_NONE, 0 };
+    int changes = stores;
+
+    // only Fx65 touches more than Vx and VF
+    if (memcmp(V, machine->V, sizeof(V)) != 0) {
+        int x = (opcode & 0x0F00) >> 8;
+        int first = (opcode & 0xF0FF) == 0xF065 ? 0 : x;
+
+        for (int r = first; r <= x; ++r) {
+            if (V[r] != machine->V[r]) {
+                append(trace, &base, TRACE_REGISTER, r, V[r], machine->V[r]);
+                ++changes;
+            }
+        }
+        if (x != 0xF && V[0xF] != machine->V[0xF]) {
+            append(trace, &base, TRACE_REGISTER, 0xF, V[0xF], machine->V[0xF]);
+            ++changes;
+        }
+    }
+
+    if (I != machine->I) {
+        append(trace, &base, TRACE_INDEX, 0, I, machine->I);
+        ++changes;
+    }
+
+    for (int i = 0; i < stores; ++i)
+        append(trace, &base, TRACE_MEMORY, I + i, saved[i], machine->RAM[I + i]);
+
+    // a halted machine doesn't execute, so nothing was written
+    if (((opcode & 0xF0FF) == 0xF015 || (opcode & 0xF0FF) == 0xF018) && pc != machine->PC) {
+        int timer = (opcode & 0x00FF) == 0x15 ? TRACE_DT : TRACE_ST;
+        append(trace, &base, TRACE_REGISTER, timer, timer == TRACE_DT ? DT : ST,
+               machine->V[(opcode & 0x0F00) >> 8]);
+        ++changes;
+    }
+
+    if (SP != machine->SP) {
+        if (machine->SP > SP) {
+            append(trace, &base, TRACE_STACK, SP, slot, machine->stack[SP]);
+            ++changes;
+        }
+        append(trace, &base, TRACE_REGISTER, TRACE_SP, SP, machine->SP);
+        ++changes;
+    }
+
+    if (!changes)
+        append(trace, &base, TRACE_NONE, 0, 0, 0);
+
+    return running;
+}
+
+// Writes out whatever is buffered and closes the file
+int trace_close(trace_t *trace) {
+    if (trace->count)
+        flush(trace);
+
+    // wait for the writer to give the last buffer back, then wake it up
+    // with nothing pending
+    sem_wait(&trace->spare);
+    sem_post(&trace->full);
+    pthread_join(trace->thread, NULL);
+    sem_destroy(&trace->full);
+    sem_destroy(&trace->spare);
+
+    int success = fclose(trace->fp) == 0;
+
+    printf("Traced %llu cycles in %lu records, %llu bytes (%lu stalls)\n",
+           (unsigned long long) trace->cycle, trace->records, trace->bytes, trace->stalls);
+
+    free(trace->buffers[0]);
+    free(trace->buffers[1]);
+    free(trace->block);
+    free(trace);
+
+    return success;
+}
+
+int trace_readerOpen(trace_reader_t *reader, const char *filename) {
+    char magic[TRACE_MAGIC_LEN];
+
+    memset(reader, 0, sizeof(trace_reader_t));
+    reader->fp = fopen(filename, "rb");
+    if (!reader->fp) {
+        printf("Could not open trace file %s\n", filename);
+        return 0;
+    }
+
+    if (fread(magic, 1, TRACE_MAGIC_LEN, reader->fp) != TRACE_MAGIC_LEN
+        || memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0) {
+        printf("%s is not a trace file\n", filename);
+        fclose(reader->fp);
+        reader->fp = NULL;
+        return 0;
+    }
+
+    return 1;
+}
+
+// Decodes the next record into reader->record, with the full cycle count
+// in reader->cycle; returns 0 at the end of the file or on a truncated
+// record.
+int trace_readerNext(trace_reader_t *reader) {
+    FILE *fp = reader->fp;
+    trace_record_t *r = &reader->record;
+    uint32_t delta = 1;
+    int value;
+
+    while (!reader->left) {
+        if (!readVarint(fp, &reader->left))
+            return 0;
+    }
+    --reader->left;
+
+    int flags = fgetc(fp);
+    if (flags == EOF)
+        return 0;
+
+    if (!(flags & FLAG_SAME_INSTRUCTION)) {
+        if (!(flags & FLAG_NEXT_CYCLE) && !readVarint(fp, &delta))
+            return 0;
+        reader->cycle += delta;
+
+        if (flags & FLAG_NEXT_PC) {
+            r->pc += 2;
+        }
+        else {
+            if ((value = readU16(fp)) < 0)
+                return 0;
+            r->pc = value;
+        }
+
+        if (flags & FLAG_SAME_OPCODE) {
+            r->opcode = reader->lastOpcode[r->pc & (RAMSIZE - 1)];
+        }
+        else {
+            if ((value = readU16(fp)) < 0)
+                return 0;
+            r->opcode = value;
+        }
+        reader->lastOpcode[r->pc & (RAMSIZE - 1)] = r->opcode;
+    }
+
+    r->kind = flags & KIND_MASK;
+    r->cycle = (uint32_t) reader->cycle;
+    r->target = r->oldValue = r->newValue = 0;
+
+    switch (r->kind) {
+    case TRACE_REGISTER:
+        r->target = fgetc(fp);
+        r->oldValue = fgetc(fp);
+        if ((value = fgetc(fp)) == EOF)
+            return 0;
+        r->newValue = value;
+        break;
+    case TRACE_INDEX:
+        r->oldValue = readU16(fp);
+        if ((value = readU16(fp)) < 0)
+            return 0;
+        r->newValue = value;
+        break;
+    case TRACE_MEMORY:
+        r->target = readU16(fp);
+        r->oldValue = fgetc(fp);
+        if ((value = fgetc(fp)) == EOF)
+            return 0;
+        r->newValue = value;
+        break;
+    case TRACE_STACK:
+        r->target = fgetc(fp);
+        r->oldValue = readU16(fp);
+        if ((value = readU16(fp)) < 0)
+            return 0;
+        r->newValue = value;
+        break;
+    case TRACE_NONE:
+        break;
+    default:
+        return 0;
+    }
+
+    return 1;
+}
+
+void trace_readerClose(trace_reader_t *reader) {
+    if (reader->fp)
+        fclose(reader->fp);
+    reader->fp = NULL;
+}
@@ -0,0 +1,81 @@
+#ifndef CHIP8_TRACE_H_
+#define CHIP8_TRACE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "chip8.h"
+
+// Trace file layout (all integers little endian):
+//
+//   header:  "CH8TRC" 0x00 0x02
+//   blocks:  varint record count, then the records, each starting with a
+//            flags byte:
+//
+//     bits 0-2  kind (trace_kind)
+//     bit 3     same instruction as the previous record: no cycle, PC or
+//               opcode follow
+//     bit 4     cycle is the previous one plus 1, else a varint delta follows
+//     bit 5     PC is the previous one plus 2, else a uint16 follows
+//     bit 6     opcode is the one last seen at this PC, else a uint16 follows
+//
+//   followed by what changed: for a register its number, old and new value
+//   (a byte each), for I the old and new value (uint16 each), for a memory
+//   write the address (uint16) and old and new byte, for a stack write the
+//   slot (a byte) and old and new entry (uint16 each).
+//
+// Registers past VF are the timers and the stack pointer. Timer records
+// carry the value Fx15/Fx18 wrote, not the per-cycle countdown.
+//
+// An instruction that changes several things gets a record per change,
+// one that changes nothing visible a single TRACE_NONE record. Cycles
+// count chip8_cycle calls since trace_open.
+#define TRACE_MAGIC "CH8TRC\0\2"
+#define TRACE_MAGIC_LEN 8
+#define TRACE_BUFFER_RECORDS 16384
+
+#define TRACE_DT 16
+#define TRACE_ST 17
+#define TRACE_SP 18
+#define TRACE_REGISTERS 19
+
+typedef enum {
+    TRACE_NONE,
+    TRACE_REGISTER,
+    TRACE_INDEX,
+    TRACE_MEMORY,
+    TRACE_STACK
+} trace_kind;
+
+typedef struct trace_record {
+    uint32_t cycle;
+    uint16_t pc;
+    uint16_t opcode;
+    uint16_t target;    // register number, memory address or stack slot
+    uint16_t oldValue;
+    uint16_t newValue;
+    uint8_t kind;
+    uint8_t pad;
+} trace_record_t;
+
+// One trace_t per emulating thread: records go into one of two buffers
+// while a background thread compresses the other one to the file.
+typedef struct trace trace_t;
+
+extern trace_t *trace_open(const char *filename);
+extern int trace_step(trace_t *trace, chip8_t *machine);
+extern int trace_close(trace_t *trace);
+
+typedef struct trace_reader {
+    FILE *fp;
+    uint32_t left;
+    uint64_t cycle;
+    trace_record_t record;
+    uint16_t lastOpcode[RAMSIZE];
+} trace_reader_t;
+
+extern int trace_readerOpen(trace_reader_t *reader, const char *filename);
+extern int trace_readerNext(trace_reader_t *reader);
+extern void trace_readerClose(trace_reader_t *reader);
+
+#endif
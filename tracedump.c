@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+// Matches everything
+#define ANY -1
+
+// Registers past VF
+static const char *registerNames[TRACE_REGISTERS - NUM_REGISTERS] = { "DT", "ST", "SP" };
+
+static long parseNumber(const char *text) {
+    char *end;
+    long value = strtol(text, &end, 0);
+    return (*text && !*end && value >= 0) ? value : -2;
+}
+
+static void printRecord(const trace_reader_t *reader) {
+    const trace_record_t *r = &reader->record;
+
+    printf("%12llu  %03X  %04X", (unsigned long long) reader->cycle, r->pc, r->opcode);
+
+    switch (r->kind) {
+    case TRACE_REGISTER:
+        if (r->target < NUM_REGISTERS)
+            printf("  V%X    %02X -> %02X", r->target, r->oldValue, r->newValue);
+        else
+            printf("  %s    %02X -> %02X", registerNames[r->target - NUM_REGISTERS],
+                   r->oldValue, r->newValue);
+        break;
+    case TRACE_INDEX:
+        printf("  I   %03X -> %03X", r->oldValue, r->newValue);
+        break;
+    case TRACE_MEMORY:
+        printf("  [%03X] %02X -> %02X", r->target, r->oldValue, r->newValue);
+        break;
+    case TRACE_STACK:
+        printf("  S%X   %03X -> %03X", r->target, r->oldValue, r->newValue);
+        break;
+    }
+
+    printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+    long pc = ANY;
+    long addr = ANY;
+    long reg = ANY;
+    int usage = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "p:a:r:")) != -1) {
+        switch (opt) {
+        case 'p':
+            pc = parseNumber(optarg);
+            usage |= pc < 0;
+            break;
+        case 'a':
+            addr = parseNumber(optarg);
+            usage |= addr < 0;
+            break;
+        case 'r':
+            reg = parseNumber(optarg);
+            usage |= reg < 0 || reg >= TRACE_REGISTERS;
+            break;
+        default:
+            usage = 1;
+            break;
+        }
+    }
+
+    if (argc - optind != 1 || usage) {
+        printf("Usage: %s [-p PC] [-a ADDRESS] [-r REGISTER] TRACE\n", argv[0]);
+        printf("  -p  instructions at PC\n");
+        printf("  -a  writes to ADDRESS, and instructions that point I at it\n");
+        printf("  -r  changes to register VREGISTER; 16 is DT, 17 ST and 18 SP\n");
+        printf("Numbers may be given in hex as 0x200. Filters combine with and.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    trace_reader_t *reader = malloc(sizeof(trace_reader_t));
+    if (!reader || !trace_readerOpen(reader, argv[optind]))
+        exit(EXIT_FAILURE);
+
+    unsigned long matched = 0;
+    while (trace_readerNext(reader)) {
+        const trace_record_t *r = &reader->record;
+
+        if (pc != ANY && r->pc != pc)
+            continue;
+        if (addr != ANY
+            && !(r->kind == TRACE_MEMORY && r->target == addr)
+            && !(r->kind == TRACE_INDEX && r->newValue == addr))
+            continue;
+        if (reg != ANY && !(r->kind == TRACE_REGISTER && r->target == reg))
+            continue;
+
+        printRecord(reader);
+        ++matched;
+    }
+
+    fprintf(stderr, "%lu records up to cycle %llu\n",
+            matched, (unsigned long long) reader->cycle);
+
+    trace_readerClose(reader);
+    free(reader);
+
+    return 0;
+}